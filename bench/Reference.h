@@ -0,0 +1,690 @@
+// reference implementations of native codecs, color sorting and palette optimization
+//
+// Verbatim copies of the original kernels, kept as oracles for sfc_verify. Do not optimize these.
+//
+// david lindecrantz <optiroc@me.com>
+
+#pragma once
+
+#include "Common.h"
+#include "Image.h"
+#include "Mode.h"
+
+namespace sfc::reference {
+
+//
+// to/from native color data
+//
+
+// pack scaled rgba color to native format
+inline byte_vec_t pack_native_color(const rgba_t color, Mode mode) {
+  byte_vec_t v;
+  switch (mode) {
+  case Mode::snes:
+  case Mode::snes_mode7:
+  case Mode::gbc:
+  case Mode::gba:
+  case Mode::gba_affine:
+    v.push_back((color & 0x1f) | ((color >> 3) & 0xe0));
+    v.push_back(((color >> 11) & 0x03) | ((color >> 14) & 0x7c));
+    break;
+  case Mode::gb:
+    v.push_back((0xff - (color & 0x3)) & 0x3);
+    break;
+  case Mode::md:
+    v.push_back(((color << 1) & 0x0e) | ((color >> 3) & 0xe0));
+    v.push_back(((color >> 15) & 0x0e));
+    break;
+  case Mode::pce:
+  case Mode::pce_sprite:
+    v.push_back(((color >> 16) & 0x07) | (color << 3 & 0x38) | ((color >> 2) & 0xc0));
+    v.push_back((color >> 10) & 0x01);
+    break;
+  case Mode::ws:
+  case Mode::ngp:
+    // TODO: WonderSwan technically supports 8 out of 16 gray shades.
+    // Currently, we do not support this additional distinction.
+    // Note that Neo Geo Pocket only supports 8 shades.
+    v.push_back(color ^ 0x07);
+    break;
+  case Mode::wsc:
+  case Mode::gg:
+  case Mode::wsc_packed:
+    v.push_back(((color >> 16) & 0x0f) | ((color >> 4) & 0xf0));
+    v.push_back((color & 0x0f));
+    break;
+  case Mode::ngpc:
+    v.push_back((color & 0x0f) | ((color >> 4) & 0xf0));
+    v.push_back(((color >> 16) & 0x0f));
+    break;
+  case Mode::sms:
+    v.push_back(((color >> 12) & 0x30) | ((color >> 6) & 0x0C) | (color & 3));
+    break;
+  case Mode::none:
+    break;
+  }
+  return v;
+}
+
+// pack scaled rgba colors to native format
+inline byte_vec_t pack_native_colors(const rgba_vec_t& colors, Mode mode) {
+  byte_vec_t data;
+
+  if (mode == Mode::gb) {
+    if (colors.size() != 4) {
+      throw std::runtime_error("gb palette size not equal to 4");
+    }
+    uint8_t c = reference::pack_native_color(colors[0], mode)[0];
+    c |= reference::pack_native_color(colors[1], mode)[0] << 2;
+    c |= reference::pack_native_color(colors[2], mode)[0] << 4;
+    c |= reference::pack_native_color(colors[3], mode)[0] << 6;
+    data.push_back(c);
+  } else if (mode == Mode::ws) {
+    // TODO: WonderSwan technically supports 8 out of 16 grayscale colors.
+    // Currently, we do not support this additional distinction.
+    if (colors.size() != 4) {
+      throw std::runtime_error("ws palette size not equal to 4");
+    }
+    uint16_t c = reference::pack_native_color(colors[0], mode)[0];
+    c |= reference::pack_native_color(colors[1], mode)[0] << 4;
+    c |= reference::pack_native_color(colors[2], mode)[0] << 8;
+    c |= reference::pack_native_color(colors[3], mode)[0] << 12;
+    data.push_back(c & 0xFF);
+    data.push_back(c >> 8);
+  } else {
+    for (const auto& c : colors) {
+      auto nc = reference::pack_native_color(c, mode);
+      data.insert(data.end(), nc.begin(), nc.end());
+    }
+  }
+  return data;
+}
+
+// unpack native format color to (scaled) rgba color
+inline rgba_vec_t unpack_native_colors(const byte_vec_t& colors, Mode mode) {
+  rgba_vec_t v;
+  switch (mode) {
+  case Mode::snes:
+  case Mode::snes_mode7:
+  case Mode::gbc:
+  case Mode::gba:
+  case Mode::gba_affine:
+    if (colors.size() % 2 != 0) {
+      throw std::runtime_error("native palette size not a multiple of 2");
+    }
+    for (unsigned i = 0; i < colors.size(); i += 2) {
+      uint16_t cw = (colors[i + 1] << 8) + colors[i];
+      rgba_t nc = (cw & 0x001f) | ((cw & 0x03e0) << 3) | ((cw & 0x7c00) << 6) | 0xff000000;
+      v.push_back(nc);
+    }
+    break;
+  case Mode::sms:
+    for (unsigned i = 0; i < colors.size(); i++) {
+      rgba_t nc = (colors[i] & 3) | ((colors[i] & 0xC) << 6) | ((colors[i] & 0x30) << 12) | 0xff000000;
+      v.push_back(nc);
+    }
+    break;
+  case Mode::gb:
+    if (colors.size() != 1) {
+      throw std::runtime_error("native palette size not one byte");
+    }
+    for (unsigned i = 0; i < 4; ++i) {
+      rgba_t rgba;
+      switch ((colors[0] >> (i * 2)) & 0x3) {
+        case 0: rgba = 0xff030303; break;
+        case 1: rgba = 0xff020202; break;
+        case 2: rgba = 0xff010101; break;
+        case 3: rgba = 0xff000000; break;
+        default:
+          rgba = 0;
+      }
+      v.push_back(rgba);
+    }
+    break;
+  case Mode::gg:
+    if (colors.size() % 2 != 0) {
+      throw std::runtime_error("native palette size not a multiple of 2");
+    }
+    for (unsigned i = 0; i < colors.size(); i += 2) {
+      uint16_t cw = (colors[i + 1] << 8) + colors[i];
+      rgba_t nc = (cw & 0x00f) | ((cw & 0x00f0) << 4) | ((cw & 0x0f00) << 8) | 0xff000000;
+      v.push_back(nc);
+    }
+    break;
+  case Mode::md:
+    if (colors.size() % 2 != 0) {
+      throw std::runtime_error("native palette size not a multiple of 2");
+    }
+    for (unsigned i = 0; i < colors.size(); i += 2) {
+      uint16_t cw = (colors[i + 1] << 8) + colors[i];
+      rgba_t nc = ((cw & 0x00e) >> 1) | ((cw & 0x00e0) << 3) | ((cw & 0x0e00) << 7) | 0xff000000;
+      v.push_back(nc);
+    }
+    break;
+  case Mode::pce:
+  case Mode::pce_sprite:
+    if (colors.size() % 2 != 0) {
+      throw std::runtime_error("native palette size not a multiple of 2");
+    }
+    for (unsigned i = 0; i < colors.size(); i += 2) {
+      uint16_t cw = (colors[i + 1] << 8) + colors[i];
+      rgba_t nc = ((cw & 0x0038) >> 3) | ((cw & 0x0007) << 8) | ((cw & 0x1c00) << 10) | 0xff000000;
+      v.push_back(nc);
+    }
+    break;
+  case Mode::ws:
+    // TODO: WonderSwan technically supports 8 out of 16 gray shades.
+    // Currently, we do not support this additional distinction.
+    if (colors.size() != 2) {
+      throw std::runtime_error("native palette size not two bytes");
+    }
+    for (unsigned i = 0; i < 4; ++i) {
+      rgba_t rgba;
+      uint32_t c = (colors[i >> 1] >> ((i & 0x01) * 4)) & 0x7;
+      rgba = 0xff000000 | ((c ^ 0x7) * 0x10101);
+      v.push_back(rgba);
+    }
+    break;
+  case Mode::ngp:
+    if (colors.size() != 4) {
+      throw std::runtime_error("native palette size not four bytes");
+    }
+    for (unsigned i = 0; i < 4; ++i) {
+      rgba_t rgba;
+      uint32_t c = colors[i] & 0x7;
+      rgba = 0xff000000 | ((c ^ 0x7) * 0x10101);
+      v.push_back(rgba);
+    }
+    break;
+  case Mode::wsc:
+  case Mode::wsc_packed:
+    if (colors.size() % 2 != 0) {
+      throw std::runtime_error("native palette size not a multiple of 2");
+    }
+    for (unsigned i = 0; i < colors.size(); i += 2) {
+      uint16_t cw = (colors[i + 1] << 8) + colors[i];
+      rgba_t nc = 0xff000000 | ((cw & 0xf00) >> 8) | ((cw & 0xf0) << 4) | ((cw & 0xf) << 16);
+      v.push_back(nc);
+    }
+    break;
+  case Mode::ngpc:
+    if (colors.size() % 2 != 0) {
+      throw std::runtime_error("native palette size not a multiple of 2");
+    }
+    for (unsigned i = 0; i < colors.size(); i += 2) {
+      uint16_t cw = (colors[i + 1] << 8) + colors[i];
+      rgba_t nc = 0xff000000 | (cw & 0xf) | ((cw & 0xf0) << 4) | ((cw & 0xf00) << 8);
+      v.push_back(nc);
+    }
+    break;
+  case Mode::none:
+    break;
+  }
+  return v;
+}
+
+inline byte_vec_t pack_native_tile(const index_vec_t& data, Mode mode, unsigned bpp, unsigned width, unsigned height) {
+
+  // wsc/sms/gg planar style bit planes
+  auto make_4bit_planes = [](const index_vec_t& in_data, unsigned plane_index) {
+    byte_vec_t p(32);
+    if (in_data.empty())
+      return p;
+
+    index_t mask0 = 1;
+    for (unsigned i = 0; i < plane_index; ++i)
+      mask0 <<= 1;
+    index_t mask1 = mask0 << 1;
+    index_t mask2 = mask1 << 1;
+    index_t mask3 = mask2 << 1;
+
+    unsigned shift0 = plane_index;
+    unsigned shift1 = plane_index + 1;
+    unsigned shift2 = plane_index + 2;
+    unsigned shift3 = plane_index + 3;
+
+    for (unsigned y = 0; y < 8; ++y) {
+      for (unsigned x = 0; x < 8; ++x) {
+        p[y * 4 + 0] |= ((in_data[y * 8 + x] & mask0) >> shift0) << (7 - x);
+        p[y * 4 + 1] |= ((in_data[y * 8 + x] & mask1) >> shift1) << (7 - x);
+        p[y * 4 + 2] |= ((in_data[y * 8 + x] & mask2) >> shift2) << (7 - x);
+        p[y * 4 + 3] |= ((in_data[y * 8 + x] & mask3) >> shift3) << (7 - x);
+      }
+    }
+    return p;
+  };
+
+  // snes/gameboy style bit planes
+  auto make_2bit_planes = [](const index_vec_t& in_data, unsigned plane_index) {
+    byte_vec_t p(16);
+    if (in_data.empty())
+      return p;
+
+    index_t mask0 = 1;
+    for (unsigned i = 0; i < plane_index; ++i)
+      mask0 <<= 1;
+    index_t mask1 = mask0 << 1;
+
+    unsigned shift0 = plane_index;
+    unsigned shift1 = plane_index + 1;
+
+    for (unsigned y = 0; y < 8; ++y) {
+      for (unsigned x = 0; x < 8; ++x) {
+        p[y * 2 + 0] |= ((in_data[y * 8 + x] & mask0) >> shift0) << (7 - x);
+        p[y * 2 + 1] |= ((in_data[y * 8 + x] & mask1) >> shift1) << (7 - x);
+      }
+    }
+    return p;
+  };
+
+  // regular bit planes
+  auto make_1bit_planes = [](const index_vec_t& in_data, unsigned plane, bool reverse) {
+    if (in_data.size() % 8)
+      throw std::runtime_error("programmer error (in_data not multiple of 8 in make_1bit_planes)");
+
+    size_t plane_size = in_data.size() >> 3;
+    byte_vec_t p(plane_size);
+
+    index_t mask = 1;
+    for (unsigned i = 0; i < plane; ++i)
+      mask <<= 1;
+
+    for (unsigned index_b = 0, index_i = 0; index_b < plane_size; ++index_b) {
+      index_t byte = 0;
+      for (unsigned b = 0; b < 8; ++b) {
+        if (in_data[index_i + b] & mask) {
+          if (reverse)
+            byte |= 1 << (7-b);
+          else
+            byte |= 1 << b;
+        }
+      }
+      p[index_b] = byte;
+      index_i += 8;
+    }
+    return p;
+  };
+
+  // gba/md style 2 pixels per byte data
+  auto make_4bpp_bitpack = [](const index_vec_t& in_data, bool endian_swap) {
+    if (in_data.size() % 2)
+      throw std::runtime_error("programmer error (in_data not multiple of 2 in make_4bpp_bitpack)");
+
+    byte_vec_t bv(in_data.size() >> 1);
+    if (endian_swap) {
+      for (unsigned i = 0; i < bv.size(); ++i)
+        bv[i] = (0x0f & in_data[(i << 1) + 1]) | (0xf0 & (in_data[i << 1] << 4));
+
+    } else {
+      for (unsigned i = 0; i < bv.size(); ++i)
+        bv[i] = (0x0f & in_data[i << 1]) | (0xf0 & (in_data[(i << 1) + 1] << 4));
+
+    }
+    return bv;
+  };
+
+  // vb/ngp style 4 pixels per byte data
+  auto make_2bpp_bitpack = [](const index_vec_t& in_data, bool reverse) {
+    byte_vec_t p(16);
+    if (in_data.empty())
+      return p;
+
+    for (unsigned y = 0; y < 8; ++y) {
+      for (unsigned x = 0; x < 8; ++x) {
+        unsigned px = reverse ? 7 - x : x;
+        p[(y << 1) | (px >> 2)] |= (in_data[y * 8 + x] & 0x03) << ((px << 1) & 6);
+      }
+    }
+    return p;
+  };
+
+  byte_vec_t nd;
+
+  if (mode == Mode::snes || mode == Mode::gb || mode == Mode::gbc || mode == Mode::pce) {
+    if (width != 8 || height != 8)
+      throw std::runtime_error(
+        fmt::format("programmer error (tile size not 8x8 in pack_native_tile() for mode \"{}\")", sfc::mode(mode)));
+
+    unsigned planes = bpp >> 1;
+    for (unsigned i = 0; i < planes; ++i) {
+      auto plane = make_2bit_planes(data, i * 2);
+      nd.insert(nd.end(), plane.begin(), plane.end());
+    }
+    // 1bpp had 0 iterations
+    if(bpp == 1) {
+      auto plane = make_1bit_planes(data, 0, true);
+      nd.insert(nd.end(), plane.begin(), plane.end());
+    }
+
+  } else if (mode == Mode::ws || mode == Mode::wsc || mode == Mode::gg || mode == Mode::sms) {
+    if (width != 8 || height != 8)
+      throw std::runtime_error(
+        fmt::format("programmer error (tile size not 8x8 in pack_native_tile() for mode \"{}\")", sfc::mode(mode)));
+
+    if (bpp == 4) {
+      nd = make_4bit_planes(data, 0);
+    } else if (bpp == 2) {
+      nd = make_2bit_planes(data, 0);
+    } else {
+      throw std::runtime_error(
+        fmt::format("programmer error (unsupported bpp for mode \"{}\")", sfc::mode(mode)));
+    }
+
+  } else if (mode == Mode::ngp || mode == Mode::ngpc) {
+    if (width != 8 || height != 8)
+      throw std::runtime_error(
+        fmt::format("programmer error (tile size not 8x8 in pack_native_tile() for mode \"{}\")", sfc::mode(mode)));
+
+    if (bpp == 2) {
+      nd = make_2bpp_bitpack(data, true);
+    } else {
+      throw std::runtime_error(
+        fmt::format("programmer error (unsupported bpp for mode \"{}\")", sfc::mode(mode)));
+    }
+
+  } else if (mode == Mode::snes_mode7) {
+    nd = data;
+
+  } else if (mode == Mode::gba || mode == Mode::gba_affine || mode == Mode::md || mode == Mode::wsc_packed) {
+    if (bpp == 8) {
+      nd = data;
+    } else if (bpp == 4) {
+      nd = make_4bpp_bitpack(data, mode == Mode::wsc_packed);
+    } else {
+      throw std::runtime_error(
+        fmt::format("programmer error (unsupported bpp for mode \"{}\")", sfc::mode(mode)));
+    }
+
+  } else if (mode == Mode::pce_sprite) {
+    for (unsigned p = 0; p < 4; ++p) {
+      auto plane = make_1bit_planes(data, p, false);
+      nd.insert(nd.end(), plane.begin(), plane.end());
+    }
+  }
+
+  return nd;
+}
+
+inline index_vec_t unpack_native_tile(const byte_vec_t& data, Mode mode, unsigned bpp, unsigned width, unsigned height) {
+
+  auto add_1bit_plane = [](index_vec_t& out_data, const byte_vec_t& in_data, unsigned plane_index) {
+    int plane_offset = ((plane_index >> 1) * 16) + (plane_index & 1);
+    for (int y = 0; y < 8; ++y) {
+      for (int x = 0; x < 8; ++x) {
+        out_data[y * 8 + x] += ((in_data[plane_offset + (y * 2)] >> (7 - x)) & 1) << plane_index;
+      }
+    }
+  };
+
+  auto add_1bit_plane_4bpp = [](index_vec_t& out_data, const byte_vec_t& in_data, unsigned plane_index) {
+    int plane_offset = ((plane_index >> 2) * 32) + (plane_index & 3);
+    for (int y = 0; y < 8; ++y) {
+      for (int x = 0; x < 8; ++x) {
+        out_data[y * 8 + x] += ((in_data[plane_offset + (y * 4)] >> (7 - x)) & 1) << plane_index;
+      }
+    }
+  };
+
+  auto add_2bpp_bitpack = [](index_vec_t& out_data, const byte_vec_t& in_data, bool reverse) {
+    for (unsigned y = 0; y < 8; ++y) {
+      for (unsigned x = 0; x < 8; ++x) {
+        unsigned px = reverse ? 7 - x : x;
+        out_data[y * 8 + x] = (in_data[(y << 1) | (px >> 2)] >> ((px << 1) & 6)) & 0x03;
+      }
+    }
+  };
+
+  index_vec_t ud(width * height);
+
+  if (mode == Mode::snes || mode == Mode::gb || mode == Mode::gbc || mode == Mode::pce) {
+    for (unsigned i = 0; i < bpp; ++i)
+      add_1bit_plane(ud, data, i);
+
+  } else if (mode == Mode::ws || mode == Mode::wsc || mode == Mode::gg || mode == Mode::sms) {
+    if (bpp == 4) {
+      for (unsigned i = 0; i < bpp; ++i)
+        add_1bit_plane_4bpp(ud, data, i);
+    } else if (bpp == 2) {
+      for (unsigned i = 0; i < bpp; ++i)
+        add_1bit_plane(ud, data, i);
+    } else {
+      throw std::runtime_error(
+        fmt::format("programmer error (unsupported bpp for mode \"{}\")", sfc::mode(mode)));
+    }
+
+  } else if (mode == Mode::snes_mode7) {
+    ud = data;
+
+  } else if (mode == Mode::gba || mode == Mode::gba_affine || mode == Mode::md) {
+    if (bpp == 4) {
+      for (unsigned i = 0; i < data.size(); ++i) {
+        ud[(i << 1) + 0] = data[i] & 0x0f;
+        ud[(i << 1) + 1] = (data[i] & 0xf0) >> 4;
+      }
+    } else {
+      ud = data;
+    }
+
+  } else if (mode == Mode::wsc_packed) {
+    for (unsigned i = 0; i < data.size(); ++i) {
+      ud[(i << 1) + 0] = (data[i] & 0xf0) >> 4;
+      ud[(i << 1) + 1] = data[i] & 0x0f;
+    }
+
+  } else if (mode == Mode::ngp || mode == Mode::ngpc) {
+    if (bpp == 2) {
+      add_2bpp_bitpack(ud, data, true);
+    } else {
+      throw std::runtime_error(
+        fmt::format("programmer error (unsupported bpp for mode \"{}\")", sfc::mode(mode)));
+    }
+
+  } else if (mode == Mode::pce_sprite) {
+    // TODO: read pce_sprite data
+    throw std::runtime_error("Using pce_sprite native data as input not implemented");
+  }
+
+  return ud;
+}
+
+
+//
+// map entries
+//
+
+struct Entry final {
+  unsigned tile_index = 0;
+  unsigned palette_index = 0;
+  bool flip_h = false;
+  bool flip_v = false;
+};
+
+inline byte_vec_t pack_native_mapentry(const Entry& entry, Mode mode) {
+  byte_vec_t v;
+  switch (mode) {
+  case Mode::snes:
+    v.push_back(entry.tile_index & 0xff);
+    v.push_back(((entry.tile_index >> 8) & 0x03) | ((entry.palette_index << 2) & 0x1c) | (entry.flip_h << 6) | (entry.flip_v << 7));
+    break;
+
+  case Mode::snes_mode7:
+    v.push_back(entry.tile_index & 0xff);
+    break;
+
+  case Mode::gb:
+    v.push_back(entry.tile_index & 0xff);
+    break;
+
+  case Mode::sms:
+  case Mode::gg:
+    v.push_back(entry.tile_index & 0xff);
+    v.push_back(((entry.tile_index >> 8) & 0x01) | (entry.flip_h << 1) | (entry.flip_v << 2) | ((entry.palette_index << 3) & 0x8));
+    // SMS and GG support depth information per tile in tilemap, instead of per sprite. But superfamiconv doesn't provide that rope?
+    break;
+
+  case Mode::gbc:
+    v.push_back(entry.tile_index & 0xff);
+    v.push_back(((entry.palette_index) & 0x07) | ((entry.tile_index >> 5) & 0x08) | (entry.flip_h << 5) | (entry.flip_v << 6));
+    break;
+
+  case Mode::gba:
+    v.push_back(entry.tile_index & 0xff);
+    v.push_back(((entry.tile_index >> 8) & 0x03) | (entry.flip_h << 2) | (entry.flip_v << 3) | ((entry.palette_index << 4) & 0xf0));
+    break;
+
+  case Mode::gba_affine:
+    v.push_back(entry.tile_index & 0xff);
+    break;
+
+  case Mode::md:
+    v.push_back(entry.tile_index & 0xff);
+    v.push_back(((entry.tile_index >> 8) & 0x07) | (entry.flip_h << 3) | (entry.flip_v << 4) | ((entry.palette_index << 5) & 0x60));
+    break;
+
+  case Mode::pce:
+    v.push_back(entry.tile_index & 0xff);
+    v.push_back(((entry.tile_index >> 8) & 0x0f) | ((entry.palette_index << 4) & 0xf0));
+    break;
+
+  case Mode::ws:
+  case Mode::wsc:
+  case Mode::wsc_packed:
+    v.push_back(entry.tile_index & 0xff);
+    v.push_back(((entry.tile_index >> 8) & 0x01) | ((entry.palette_index << 1) & 0x1e) | ((entry.tile_index >> 4) & 0x20) | (entry.flip_h << 6) | (entry.flip_v << 7));
+    break;
+
+  case Mode::ngp:
+    v.push_back(entry.tile_index & 0xff);
+    v.push_back(((entry.tile_index >> 8) & 0x01) | ((entry.palette_index << 5) & 0x20) | (entry.flip_v << 6) | (entry.flip_h << 7));
+    break;
+
+  case Mode::ngpc:
+    v.push_back(entry.tile_index & 0xff);
+    v.push_back(((entry.tile_index >> 8) & 0x01) | ((entry.palette_index << 1) & 0x1e) | (entry.flip_v << 6) | (entry.flip_h << 7));
+    break;
+
+  case Mode::pce_sprite:
+  case Mode::none:
+    break;
+  }
+  return v;
+}
+
+
+//
+// palette optimization
+//
+
+// functional form of old "greedy best fit" style palette optimizer
+inline rgba_set_vec_t optimized_palettes(const rgba_set_vec_t& colors, unsigned _max_colors_per_subpalette) {
+  auto filter_subsets = [](const rgba_set_vec_t& v) {
+    auto n = rgba_set_vec_t(v.size());
+    auto it = std::copy_if(v.begin(), v.end(), n.begin(), [&](const auto& s) { return !has_superset(s, v); });
+    n.resize(std::distance(n.begin(), it));
+    return n;
+  };
+
+  auto filter_redundant = [](const rgba_set_vec_t& v) {
+    auto n = rgba_set_vec_t(v.size());
+    auto it = std::copy_if(v.begin(), v.end(), n.begin(),
+                           [&](auto& s) { return s.size() < 1 ? false : std::find(n.begin(), n.end(), s) == n.end(); });
+    n.resize(std::distance(n.begin(), it));
+    return n;
+  };
+
+  auto best_fit = [&](const rgba_set_t& s, const rgba_set_vec_t& v) {
+    int best = -1;
+    unsigned i = 0;
+    for (auto& cs : v) {
+      rgba_set_t d;
+      std::set_difference(s.begin(), s.end(), cs.begin(), cs.end(), std::inserter(d, d.begin()));
+      if (d.size() + cs.size() <= _max_colors_per_subpalette)
+        best = i;
+      ++i;
+    }
+    return best;
+  };
+
+  auto sets = filter_redundant(colors);
+  sets = filter_subsets(sets);
+  std::sort(sets.begin(), sets.end(), [](auto& a, auto& b) { return a.size() < b.size(); });
+
+  rgba_set_vec_t opt = rgba_set_vec_t();
+
+  while (sets.size()) {
+    auto set = vec_pop(sets);
+    auto best_index = best_fit(set, opt);
+    if (best_index == -1) {
+      opt.push_back(set);
+    } else {
+      opt[best_index].insert(set.begin(), set.end());
+    }
+  }
+
+  std::sort(opt.begin(), opt.end(), [](auto& a, auto& b) -> bool { return a.size() > b.size(); });
+  return opt;
+}
+
+// subpalette colors produced by Palette::add_images() on an empty palette, col0 is shared if set
+inline std::vector<rgba_vec_t> palette_colors(const std::vector<Image>& palette_tiles, Mode mode, unsigned max_subpalettes,
+                                              unsigned max_colors_per_subpalette, const rgba_t* col0 = nullptr) {
+  rgba_set_vec_t palettes = rgba_set_vec_t();
+  for (const auto& c : palette_tiles) {
+    if (col0) {
+      auto colors = c.colors();
+      colors.insert(*col0);
+      palettes.push_back(reduce_colors(colors, mode));
+    } else {
+      palettes.push_back(reduce_colors(c.colors(), mode));
+    }
+  }
+
+  auto optimized = optimized_palettes(palettes, max_colors_per_subpalette);
+  if (optimized.size() > max_subpalettes)
+    throw std::runtime_error("Colors in image do not fit in available palettes. Aborting.");
+
+  std::vector<rgba_vec_t> v;
+  for (auto& cs : optimized) {
+    rgba_vec_t cv(cs.begin(), cs.end());
+    if (col0) {
+      auto p = std::find(cv.begin(), cv.end(), reduce_color(*col0, mode));
+      if (p != cv.end())
+        std::iter_swap(p, cv.begin());
+    }
+    // Subpalette::add() rejects overfull sets
+    if (cv.size() > max_colors_per_subpalette)
+      throw std::runtime_error("Colors don't fit in palette");
+    v.push_back(cv);
+  }
+  return v;
+}
+
+
+//
+// color sorting
+//
+
+// original color ordering, converting both colors to hsv on every comparison
+inline bool color_greater(const rgba_color& a, const rgba_color& o) {
+  const int segments = 8;
+  hsva_color hsva = hsva_color(a);
+  hsva_color hsva_o = hsva_color(o);
+
+  int h = (int)(segments * hsva.h);
+  int l = (int)(segments * sqrt(0.241f * a.r + 0.691f * a.g + 0.068f * a.b));
+  int v = (int)(segments * hsva.v);
+
+  int ho = (int)(segments * hsva_o.h);
+  int lo = (int)(segments * sqrt(0.241f * o.r + 0.691f * o.g + 0.068f * o.b));
+  int vo = (int)(segments * hsva_o.v);
+
+  return std::tie(h, l, v) > std::tie(ho, lo, vo);
+}
+
+inline rgba_vec_t sort_colors(rgba_vec_t colors) {
+  std::sort(colors.begin(), colors.end(),
+            [](const rgba_t& a, const rgba_t& b) -> bool { return color_greater(rgba_color(a), rgba_color(b)); });
+  return colors;
+}
+
+} /* namespace sfc::reference */
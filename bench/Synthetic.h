@@ -0,0 +1,99 @@
+// deterministic synthetic workloads
+//
+// david lindecrantz <optiroc@me.com>
+
+#pragma once
+
+#include <random>
+
+#include "Common.h"
+
+namespace sfc::bench {
+
+struct SyntheticSpec final {
+  unsigned width = 256;
+  unsigned height = 224;
+  unsigned tile_width = 8;
+  unsigned tile_height = 8;
+  float duplicate_fraction = 0.4f; // fraction of tiles repeating an earlier tile
+  float flipped_fraction = 0.2f;   // fraction of tiles repeating an earlier tile mirrored
+  unsigned colors_per_tile = 8;    // colors in each color set, including the shared color zero
+  unsigned color_sets = 4;         // number of distinct color sets
+  unsigned seed = 1;
+};
+
+// raw mt19937 output is specified by the standard, unlike the std distributions
+inline unsigned random_below(std::mt19937& rng, unsigned n) {
+  return n ? rng() % n : 0;
+}
+
+inline float random_unit(std::mt19937& rng) {
+  return (rng() % 1000000) / 1000000.0f;
+}
+
+// random opaque color with 5 significant bits per channel
+inline rgba_t random_color(std::mt19937& rng) {
+  return 0xff000000 | ((rng() & 0x1f) << 3) | ((rng() & 0x1f) << 11) | ((rng() & 0x1f) << 19);
+}
+
+// random index data
+inline index_vec_t random_indices(std::mt19937& rng, size_t size, unsigned bpp) {
+  index_vec_t v(size);
+  for (auto& i : v)
+    i = (index_t)random_below(rng, palette_size_at_bpp(bpp));
+  return v;
+}
+
+// rgba image made from tiles drawn from color sets, with a share of exact and mirrored repeats
+inline rgba_vec_t synthetic_image(const SyntheticSpec& spec) {
+  std::mt19937 rng(spec.seed);
+  const rgba_t col0 = 0xff505050;
+  const unsigned tw = spec.tile_width;
+  const unsigned th = spec.tile_height;
+
+  std::vector<rgba_vec_t> sets(spec.color_sets ? spec.color_sets : 1);
+  for (auto& set : sets) {
+    set.push_back(col0);
+    for (unsigned i = 1; i < spec.colors_per_tile; ++i)
+      set.push_back(random_color(rng));
+  }
+
+  rgba_vec_t image((size_t)spec.width * spec.height, col0);
+  std::vector<rgba_vec_t> uniques;
+
+  for (unsigned ty = 0; ty < spec.height; ty += th) {
+    for (unsigned tx = 0; tx < spec.width; tx += tw) {
+      rgba_vec_t tile(tw * th);
+      const float r = random_unit(rng);
+
+      if (!uniques.empty() && r < spec.duplicate_fraction) {
+        tile = uniques[random_below(rng, (unsigned)uniques.size())];
+
+      } else if (!uniques.empty() && r < spec.duplicate_fraction + spec.flipped_fraction) {
+        const auto& src = uniques[random_below(rng, (unsigned)uniques.size())];
+        const unsigned flip = 1 + random_below(rng, 3);
+        for (unsigned y = 0; y < th; ++y) {
+          for (unsigned x = 0; x < tw; ++x) {
+            const unsigned sx = (flip & 1) ? tw - 1 - x : x;
+            const unsigned sy = (flip & 2) ? th - 1 - y : y;
+            tile[y * tw + x] = src[sy * tw + sx];
+          }
+        }
+
+      } else {
+        const auto& set = sets[random_below(rng, (unsigned)sets.size())];
+        for (auto& p : tile)
+          p = set[random_below(rng, (unsigned)set.size())];
+        uniques.push_back(tile);
+      }
+
+      for (unsigned y = 0; y < th && ty + y < spec.height; ++y) {
+        for (unsigned x = 0; x < tw && tx + x < spec.width; ++x)
+          image[(ty + y) * spec.width + tx + x] = tile[y * tw + x];
+      }
+    }
+  }
+  return image;
+}
+
+} /* namespace sfc::bench */
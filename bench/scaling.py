@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+# scaling
+# end-to-end scaling benchmark for superfamiconv
+#
+# Generates synthetic images with sfc_gen across a size sweep, runs the short hand, palette, tiles and map
+# commands on each and writes wall time, peak RSS and output sizes to csv.
+#
+# david lindecrantz <optiroc@me.com>
+
+import argparse
+import csv
+import os
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+DEFAULT_SIZES = "128x112,256x224,512x448,1024x896,2048x1792"
+
+
+def run(cmd, timeout):
+    """Run cmd, returning (seconds, peak rss in KiB, status). Status is the exit code or "timeout"."""
+    with tempfile.TemporaryFile() as err:
+        start = time.perf_counter()
+        proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL, stderr=err)
+        timer = threading.Timer(timeout, proc.kill)
+        timer.start()
+        _, status, usage = os.wait4(proc.pid, 0)
+        elapsed = time.perf_counter() - start
+        timed_out = not timer.is_alive()
+        timer.cancel()
+        proc.returncode = os.waitstatus_to_exitcode(status)
+
+        if timed_out:
+            print(f"warning: {' '.join(cmd)} timed out after {timeout}s", file=sys.stderr)
+        elif proc.returncode != 0:
+            err.seek(0)
+            lines = err.read().decode(errors="replace").strip().splitlines()
+            print(f"warning: {' '.join(cmd)} failed: {lines[0] if lines else proc.returncode}", file=sys.stderr)
+
+    # ru_maxrss is reported in bytes on macos and KiB elsewhere
+    rss = usage.ru_maxrss // 1024 if sys.platform == "darwin" else usage.ru_maxrss
+    return elapsed, rss, "timeout" if timed_out else proc.returncode
+
+
+def file_size(path):
+    return os.path.getsize(path) if os.path.exists(path) else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description="superfamiconv scaling benchmark")
+    parser.add_argument("--bin-dir", default="build/release", help="directory containing superfamiconv and sfc_gen")
+    parser.add_argument("--out", default="scaling.csv", help="output csv path")
+    parser.add_argument("--sizes", default=DEFAULT_SIZES, help="comma separated list of WxH image sizes")
+    parser.add_argument("--modes", default="snes", help="comma separated list of modes")
+    parser.add_argument("--duplicates", default="0.4", help="comma separated list of duplicate tile fractions")
+    parser.add_argument("--flipped", default="0.2", help="comma separated list of flipped duplicate fractions")
+    parser.add_argument("--colors-per-tile", default="8", help="comma separated list of colors per color set")
+    parser.add_argument("--color-sets", default="4", help="comma separated list of color set counts")
+    parser.add_argument("--repeat", type=int, default=1, help="runs per command, the fastest is recorded")
+    parser.add_argument("--timeout", type=float, default=120, help="seconds before a command is killed")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    sfc = os.path.join(args.bin_dir, "superfamiconv")
+    gen = os.path.join(args.bin_dir, "sfc_gen")
+    for exe in (sfc, gen):
+        if not os.access(exe, os.X_OK):
+            sys.exit(f"error: {exe} not found (see --bin-dir)")
+
+    def split(s, conv):
+        return [conv(v) for v in s.split(",") if v]
+
+    sizes = [tuple(int(d) for d in s.split("x")) for s in split(args.sizes, str)]
+    fields = [
+        "mode", "width", "height", "duplicates", "flipped", "colors_per_tile", "color_sets", "command",
+        "seconds", "peak_rss_kib", "status", "palette_bytes", "tiles_bytes", "map_bytes",
+    ]
+
+    with tempfile.TemporaryDirectory(prefix="sfc_scaling_") as tmp, open(args.out, "w", newline="") as f:
+        writer = csv.DictWriter(f, fieldnames=fields)
+        writer.writeheader()
+
+        for mode in split(args.modes, str):
+            for w, h in sizes:
+                for dup in split(args.duplicates, float):
+                    for flip in split(args.flipped, float):
+                        for cpt in split(args.colors_per_tile, int):
+                            for sets in split(args.color_sets, int):
+                                image = os.path.join(tmp, "in.png")
+                                subprocess.run(
+                                    [gen, "-o", image, "-W", str(w), "-H", str(h), "-d", str(dup), "-f", str(flip),
+                                     "-c", str(cpt), "-s", str(sets), "--seed", str(args.seed)],
+                                    check=True)
+
+                                pal, til, mp = (os.path.join(tmp, n) for n in ("out.pal", "out.chr", "out.map"))
+                                commands = {
+                                    "shorthand": [sfc, "-M", mode, "-i", image, "-p", pal, "-t", til, "-m", mp],
+                                    "palette": [sfc, "palette", "-M", mode, "-i", image, "-d", pal],
+                                    "tiles": [sfc, "tiles", "-M", mode, "-i", image, "-p", pal, "-d", til],
+                                    "map": [sfc, "map", "-M", mode, "-i", image, "-p", pal, "-t", til, "-d", mp],
+                                }
+
+                                for name, cmd in commands.items():
+                                    if name in ("shorthand", "palette"):
+                                        for p in (pal, til, mp):
+                                            if os.path.exists(p):
+                                                os.remove(p)
+                                    best = min((run(cmd, args.timeout) for _ in range(max(1, args.repeat))), key=lambda r: r[0])
+                                    writer.writerow({
+                                        "mode": mode, "width": w, "height": h, "duplicates": dup, "flipped": flip,
+                                        "colors_per_tile": cpt, "color_sets": sets, "command": name,
+                                        "seconds": f"{best[0]:.6f}", "peak_rss_kib": best[1], "status": best[2],
+                                        "palette_bytes": file_size(pal), "tiles_bytes": file_size(til),
+                                        "map_bytes": file_size(mp),
+                                    })
+                                    f.flush()
+                                    print(f"{mode} {w}x{h} dup={dup} flip={flip} colors={cpt} sets={sets} "
+                                          f"{name}: {best[0]:.3f}s {best[1]} KiB", file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,303 @@
+// sfc_bench
+// kernel microbenchmarks for superfamiconv
+//
+// david lindecrantz <optiroc@me.com>
+
+#include <chrono>
+
+#include "Common.h"
+#include "Image.h"
+#include "Map.h"
+#include "Palette.h"
+#include "Synthetic.h"
+#include "Tiles.h"
+
+using namespace sfc;
+
+namespace {
+
+const std::vector<Mode> all_modes = {Mode::snes, Mode::snes_mode7, Mode::gb,         Mode::gbc, Mode::gba,  Mode::gba_affine,
+                                     Mode::md,   Mode::pce,        Mode::pce_sprite, Mode::ws,  Mode::wsc,  Mode::wsc_packed,
+                                     Mode::ngp,  Mode::ngpc,       Mode::sms,        Mode::gg};
+
+std::string filter;
+double min_time = 0.25;
+volatile size_t sink = 0;
+
+void skip(const std::string& name, const std::string& reason) {
+  if (!filter.empty() && name.find(filter) == std::string::npos)
+    return;
+  fmt::print("{:<40} skipped ({})\n", name, reason);
+}
+
+// run fn repeatedly for at least min_time seconds and report throughput
+template <typename F>
+void run(const std::string& name, size_t tiles, size_t pixels, F&& fn) {
+  if (!filter.empty() && name.find(filter) == std::string::npos)
+    return;
+
+  using clock = std::chrono::steady_clock;
+  try {
+    fn();
+  } catch (const std::exception& e) {
+    skip(name, e.what());
+    return;
+  }
+
+  unsigned iterations = 0;
+  double elapsed = 0;
+  const auto start = clock::now();
+  do {
+    fn();
+    ++iterations;
+    elapsed = std::chrono::duration<double>(clock::now() - start).count();
+  } while (elapsed < min_time);
+
+  const double per_iteration = elapsed / iterations;
+  fmt::print("{:<40} {:>14.0f} tiles/s {:>16.0f} pixels/s\n", name, tiles / per_iteration, pixels / per_iteration);
+}
+
+std::vector<unsigned> allowed_bpps(Mode mode) {
+  std::vector<unsigned> v;
+  for (unsigned bpp : {1, 2, 4, 8}) {
+    if (bpp_allowed_for_mode(bpp, mode))
+      v.push_back(bpp);
+  }
+  return v;
+}
+
+void bench_colors(Mode mode) {
+  std::mt19937 rng(1);
+  rgba_vec_t colors(256 * 64);
+  for (auto& c : colors)
+    c = rng();
+
+  run(fmt::format("reduce+normalize_color/{}", sfc::mode(mode)), colors.size() / 64, colors.size(), [&] {
+    size_t acc = 0;
+    for (auto c : colors)
+      acc += normalize_color(reduce_color(c, mode), mode);
+    sink = acc;
+  });
+}
+
+void bench_sort_colors() {
+  std::mt19937 rng(1);
+  std::vector<rgba_vec_t> palettes(64, rgba_vec_t(256));
+  for (auto& p : palettes) {
+    for (auto& c : p)
+      c = rng() | 0xff000000;
+  }
+
+  run("sort_colors/256", palettes.size(), palettes.size() * 256, [&] {
+    size_t acc = 0;
+    for (auto p : palettes) {
+      sort_colors(p);
+      acc += p[0];
+    }
+    sink = acc;
+  });
+}
+
+void bench_native_tiles(Mode mode) {
+  const unsigned size = default_tile_size_for_mode(mode);
+  const unsigned count = 256;
+
+  for (unsigned bpp : allowed_bpps(mode)) {
+    const std::string pack_name = fmt::format("pack_native_tile/{}/{}bpp", sfc::mode(mode), bpp);
+    std::mt19937 rng(bpp);
+    std::vector<index_vec_t> tiles;
+    std::vector<byte_vec_t> native;
+    try {
+      for (unsigned i = 0; i < count; ++i) {
+        tiles.push_back(bench::random_indices(rng, size * size, bpp));
+        native.push_back(pack_native_tile(tiles.back(), mode, bpp, size, size));
+      }
+    } catch (const std::exception& e) {
+      skip(pack_name, e.what());
+      continue;
+    }
+
+    run(pack_name, count, count * size * size, [&] {
+      size_t acc = 0;
+      for (const auto& t : tiles)
+        acc += pack_native_tile(t, mode, bpp, size, size).size();
+      sink = acc;
+    });
+
+    const std::string unpack_name = fmt::format("unpack_native_tile/{}/{}bpp", sfc::mode(mode), bpp);
+    if (mode == Mode::pce_sprite) {
+      skip(unpack_name, "not implemented for mode");
+      continue;
+    }
+    run(unpack_name, count, count * size * size, [&] {
+      size_t acc = 0;
+      for (const auto& n : native)
+        acc += unpack_native_tile(n, mode, bpp, size, size)[0];
+      sink = acc;
+    });
+  }
+}
+
+void bench_tile_compare(unsigned bpp) {
+  const unsigned count = 256;
+  std::mt19937 rng(bpp);
+  std::vector<Tile> tiles;
+  std::vector<Tile> flipped;
+  for (unsigned i = 0; i < count; ++i) {
+    const auto data = bench::random_indices(rng, 64, bpp);
+    const unsigned flip = bench::random_below(rng, 4);
+    tiles.push_back(Tile(pack_native_tile(data, Mode::snes, bpp, 8, 8), Mode::snes, bpp));
+    flipped.push_back(Tile(pack_native_tile(mirror(data, 8, flip & 1, flip & 2), Mode::snes, bpp, 8, 8), Mode::snes, bpp));
+  }
+
+  run(fmt::format("Tile::operator==/{}bpp", bpp), count * 2, count * 2 * 64, [&] {
+    size_t acc = 0;
+    for (unsigned i = 0; i < count; ++i) {
+      acc += tiles[i] == flipped[i];
+      acc += tiles[i] == tiles[(i + 1) % count];
+    }
+    sink = acc;
+  });
+
+  run(fmt::format("Tile::is_flipped/{}bpp", bpp), count, count * 64, [&] {
+    size_t acc = 0;
+    for (unsigned i = 0; i < count; ++i) {
+      const auto f = tiles[i].is_flipped(flipped[i]);
+      acc += f.h + f.v;
+    }
+    sink = acc;
+  });
+}
+
+void bench_conversion(Mode mode) {
+  const unsigned bpp = default_bpp_for_mode(mode);
+  const unsigned colors_per_palette = palette_size_at_bpp(bpp);
+  const bool no_flip = !tile_flipping_allowed_for_mode(mode);
+  const std::string mode_str = sfc::mode(mode);
+
+  // modes without a default palette count (gg) are benchmarked with a single subpalette, as with "--palettes 1"
+  const unsigned palette_count = std::max(1u, default_palette_count_for_mode(mode));
+
+  // stages in order, each one using the results of the previous ones
+  const std::vector<std::string> stages = {
+    fmt::format("Palette::optimized_palettes/{}", mode_str),
+    fmt::format("Tileset::add/{}", mode_str),
+    fmt::format("Map::add/{}", mode_str),
+    fmt::format("Map::native_data/{}", mode_str),
+  };
+  auto skip_stages = [&](size_t first, const std::string& reason) {
+    for (size_t i = first; i < stages.size(); ++i)
+      skip(stages[i], reason);
+  };
+
+  // keep unique tiles below the smallest per-mode tile limit
+  // color sets fit in one subpalette each (including color zero), with no more sets than subpalettes
+  bench::SyntheticSpec spec;
+  spec.duplicate_fraction = 0.75f;
+  spec.flipped_fraction = 0.1f;
+  spec.tile_width = spec.tile_height = default_tile_size_for_mode(mode);
+  spec.colors_per_tile = std::min(colors_per_palette, 8u);
+  spec.color_sets = std::min(palette_count, 4u);
+
+  const Image image(bench::synthetic_image(spec), spec.width, spec.height);
+  const auto crops = image.crops(spec.tile_width, spec.tile_height, mode);
+  const size_t pixels = (size_t)spec.width * spec.height;
+
+  auto make_palette = [&] {
+    Palette palette(mode, palette_count, colors_per_palette);
+    if (col0_is_shared_for_mode(mode))
+      palette.prime_col0(image.rgba_color_at(0));
+    palette.add_images(crops);
+    return palette;
+  };
+
+  auto make_tileset = [&](const Palette& palette) {
+    Tileset tileset(mode, bpp, spec.tile_width, spec.tile_height, false, no_flip);
+    for (const auto& crop : crops)
+      tileset.add(crop, &palette);
+    return tileset;
+  };
+
+  const unsigned map_width = div_ceil(spec.width, spec.tile_width);
+  const unsigned map_height = div_ceil(spec.height, spec.tile_height);
+  auto make_map = [&](const Tileset& tileset, const Palette& palette) {
+    Map map(mode, map_width, map_height, spec.tile_width, spec.tile_height);
+    map.add(crops, tileset, palette, bpp, 1);
+    return map;
+  };
+
+  Palette palette;
+  Tileset tileset;
+  try {
+    palette = make_palette();
+  } catch (const std::exception& e) {
+    skip_stages(0, e.what());
+    return;
+  }
+  run(stages[0], crops.size(), pixels, [&] { sink = make_palette().size(); });
+
+  try {
+    tileset = make_tileset(palette);
+    tileset.build_index();
+  } catch (const std::exception& e) {
+    skip_stages(1, e.what());
+    return;
+  }
+  run(stages[1], crops.size(), pixels, [&] { sink = make_tileset(palette).size(); });
+
+  if (mode == Mode::pce_sprite) {
+    skip_stages(2, "no map output for mode");
+    return;
+  }
+
+  Map map;
+  try {
+    map = make_map(tileset, palette);
+  } catch (const std::exception& e) {
+    skip_stages(2, e.what());
+    return;
+  }
+  run(stages[2], crops.size(), pixels, [&] { sink = make_map(tileset, palette).width(); });
+
+  const unsigned screen = default_map_size_for_mode(mode);
+  run(stages[3], crops.size(), pixels, [&] {
+    sink = map.native_data().size() + map.native_data(true, screen, screen).size();
+  });
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--min-time" && i + 1 < argc) {
+      min_time = std::atof(argv[++i]);
+    } else if (arg == "-h" || arg == "--help") {
+      fmt::print("Usage: sfc_bench [--min-time <seconds>] [<filter>]\n");
+      return 0;
+    } else {
+      filter = arg;
+    }
+  }
+
+  try {
+    for (auto mode : all_modes)
+      bench_colors(mode);
+    bench_sort_colors();
+
+    for (auto mode : all_modes)
+      bench_native_tiles(mode);
+
+    for (unsigned bpp : {2, 4, 8})
+      bench_tile_compare(bpp);
+
+    for (auto mode : all_modes)
+      bench_conversion(mode);
+
+  } catch (const std::exception& e) {
+    fmt::print(stderr, "Error: {}\n", e.what());
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,55 @@
+// sfc_fuzz
+// libFuzzer entry point for the png and native data decoders
+//
+// The first input byte selects decoder and mode, the rest is fed to the decoder.
+// Build with -DSFC_FUZZ=ON using clang.
+//
+// david lindecrantz <optiroc@me.com>
+
+#include "Common.h"
+#include "Image.h"
+#include "Palette.h"
+#include "Tiles.h"
+
+namespace {
+
+const sfc::Mode modes[] = {sfc::Mode::snes, sfc::Mode::snes_mode7, sfc::Mode::gb,         sfc::Mode::gbc, sfc::Mode::gba,  sfc::Mode::gba_affine,
+                           sfc::Mode::md,   sfc::Mode::pce,        sfc::Mode::pce_sprite, sfc::Mode::ws,  sfc::Mode::wsc,  sfc::Mode::wsc_packed,
+                           sfc::Mode::ngp,  sfc::Mode::ngpc,       sfc::Mode::sms,        sfc::Mode::gg};
+
+} // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  if (size < 1)
+    return 0;
+
+  const unsigned selector = data[0];
+  const sfc::Mode mode = modes[(selector >> 2) % (sizeof(modes) / sizeof(modes[0]))];
+  const byte_vec_t input(data + 1, data + size);
+
+  try {
+    switch (selector & 3) {
+    case 0: {
+      sfc::Image image(input);
+      // exercise the slicing path on decoded images of reasonable size
+      if ((size_t)image.width() * image.height() <= 256 * 256)
+        image.crops(8, 8, mode);
+      break;
+    }
+    case 1:
+      sfc::unpack_native_colors(input, mode);
+      break;
+    case 2:
+      sfc::Palette(input, mode, sfc::palette_size_at_bpp(sfc::default_bpp_for_mode(mode)));
+      break;
+    case 3: {
+      const unsigned size = sfc::default_tile_size_for_mode(mode);
+      sfc::Tileset(input, mode, sfc::default_bpp_for_mode(mode), size, size, !sfc::tile_flipping_allowed_for_mode(mode));
+      break;
+    }
+    }
+  } catch (const std::exception&) {
+    // rejected input is fine, crashes and sanitizer reports are not
+  }
+  return 0;
+}
@@ -0,0 +1,70 @@
+// sfc_gen
+// synthetic png workload generator for superfamiconv
+//
+// david lindecrantz <optiroc@me.com>
+
+#include <Options.h>
+#include "Common.h"
+#include "Image.h"
+#include "Synthetic.h"
+
+int main(int argc, char* argv[]) {
+  sfc::bench::SyntheticSpec spec;
+  std::string out_image;
+
+  try {
+    bool help = false;
+
+    Options options;
+    options.IndentDescription = sfc::Constants::options_indent;
+    options.Header = "Usage: sfc_gen -o <out-image> [<options>]\n";
+
+    // clang-format off
+    options.Add(out_image,               'o', "out-image",       "Output: image");
+
+    options.Add(spec.width,              'W', "width",           "Image width",                                 unsigned(256), "Settings");
+    options.Add(spec.height,             'H', "height",          "Image height",                                unsigned(224), "Settings");
+    options.Add(spec.tile_width,        '\0', "tile-width",      "Tile width",                                  unsigned(8),   "Settings");
+    options.Add(spec.tile_height,       '\0', "tile-height",     "Tile height",                                 unsigned(8),   "Settings");
+    options.Add(spec.duplicate_fraction, 'd', "duplicates",      "Fraction of tiles repeating an earlier tile", 0.4f,          "Settings");
+    options.Add(spec.flipped_fraction,   'f', "flipped",         "Fraction of tiles repeating a mirrored tile", 0.2f,          "Settings");
+    options.Add(spec.colors_per_tile,    'c', "colors-per-tile", "Colors per color set, including color zero",  unsigned(8),   "Settings");
+    options.Add(spec.color_sets,         's', "color-sets",      "Number of distinct color sets",               unsigned(4),   "Settings");
+    options.Add(spec.seed,              '\0', "seed",            "Random seed",                                 unsigned(1),   "Settings");
+
+    options.AddSwitch(help,              'h', "help",            "Show this help", false, "_");
+    // clang-format on
+
+    if (!options.Parse(argc, argv))
+      return 1;
+
+    if (argc <= 1 || help) {
+      std::cout << options.Usage();
+      return 0;
+    }
+
+    if (out_image.empty())
+      throw std::runtime_error("Output image required");
+    if (spec.width == 0 || spec.height == 0 || spec.tile_width == 0 || spec.tile_height == 0)
+      throw std::runtime_error("Image and tile dimensions must be non-zero");
+    if (spec.colors_per_tile == 0)
+      throw std::runtime_error("Colors per tile must be non-zero");
+    if (spec.duplicate_fraction < 0 || spec.flipped_fraction < 0 || spec.duplicate_fraction + spec.flipped_fraction > 1)
+      throw std::runtime_error("Duplicate and flipped fractions must be positive and sum to at most 1");
+
+  } catch (const std::exception& e) {
+    fmt::print(stderr, "Error: {}\n", e.what());
+    return 1;
+  }
+
+  try {
+    sfc::Image image(sfc::bench::synthetic_image(spec), spec.width, spec.height);
+    image.save(out_image);
+
+  } catch (const std::exception& e) {
+    fmt::print(stderr, "Error: {}\n", e.what());
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,387 @@
+// sfc_verify
+// differential checks of native codecs, color sorting and palette optimization against reference implementations
+//
+// david lindecrantz <optiroc@me.com>
+
+#include <bit>
+
+#include <fmt/format.h>
+
+#include "Common.h"
+#include "CropIndex.h"
+#include "Image.h"
+#include "Map.h"
+#include "Palette.h"
+#include "Reference.h"
+#include "Synthetic.h"
+
+using namespace sfc;
+
+namespace {
+
+const std::vector<Mode> all_modes = {Mode::snes, Mode::snes_mode7, Mode::gb,         Mode::gbc, Mode::gba,  Mode::gba_affine,
+                                     Mode::md,   Mode::pce,        Mode::pce_sprite, Mode::ws,  Mode::wsc,  Mode::wsc_packed,
+                                     Mode::ngp,  Mode::ngpc,       Mode::sms,        Mode::gg};
+
+unsigned iterations = 1000;
+unsigned seed = 1;
+unsigned checks = 0;
+unsigned failures = 0;
+
+// outcome of a call, either a value or an exception message
+template <typename T>
+struct Outcome final {
+  T value;
+  std::string error;
+  bool operator==(const Outcome& o) const { return value == o.value && error == o.error; }
+};
+
+template <typename F>
+auto outcome(F&& fn) -> Outcome<decltype(fn())> {
+  try {
+    return {fn(), ""};
+  } catch (const std::exception& e) {
+    return {{}, e.what()};
+  }
+}
+
+template <typename T>
+void check(const std::string& name, const Outcome<T>& expected, const Outcome<T>& actual, const std::string& input) {
+  ++checks;
+  if (expected == actual)
+    return;
+  if (++failures <= 20) {
+    fmt::print(stderr, "MISMATCH {}: {}\n", name, input);
+    if (expected.error != actual.error)
+      fmt::print(stderr, "  reference error: \"{}\", actual error: \"{}\"\n", expected.error, actual.error);
+  }
+}
+
+std::string hex(const byte_vec_t& v) {
+  std::string s;
+  for (auto b : v)
+    s += fmt::format("{:02x}", b);
+  return s;
+}
+
+std::vector<unsigned> tile_bpps(Mode mode) {
+  std::vector<unsigned> v;
+  for (unsigned bpp : {1, 2, 4, 8}) {
+    if (bpp_allowed_for_mode(bpp, mode))
+      v.push_back(bpp);
+  }
+  return v;
+}
+
+void verify_tiles(Mode mode, std::mt19937& rng) {
+  const unsigned size = default_tile_size_for_mode(mode);
+
+  for (unsigned bpp : tile_bpps(mode)) {
+    const std::string suffix = fmt::format("{}/{}bpp", sfc::mode(mode), bpp);
+
+    for (unsigned i = 0; i < iterations; ++i) {
+      const auto data = bench::random_indices(rng, size * size, bpp);
+      const auto expected = outcome([&] { return reference::pack_native_tile(data, mode, bpp, size, size); });
+      const auto actual = outcome([&] { return pack_native_tile(data, mode, bpp, size, size); });
+      check("pack_native_tile/" + suffix, expected, actual, hex(byte_vec_t(data.begin(), data.end())));
+
+      // unpack random native data of the size the reference packer produces
+      if (!expected.error.empty() || mode == Mode::pce_sprite)
+        continue;
+      byte_vec_t native(expected.value.size());
+      for (auto& b : native)
+        b = (uint8_t)rng();
+      check("unpack_native_tile/" + suffix, outcome([&] { return reference::unpack_native_tile(native, mode, bpp, size, size); }),
+            outcome([&] { return unpack_native_tile(native, mode, bpp, size, size); }), hex(native));
+    }
+  }
+}
+
+void verify_colors(Mode mode, std::mt19937& rng) {
+  const std::string suffix = sfc::mode(mode);
+
+  for (unsigned i = 0; i < iterations; ++i) {
+    const unsigned count = palette_size_at_bpp(1 << bench::random_below(rng, 4));
+    rgba_vec_t colors(count);
+    for (auto& c : colors)
+      c = reduce_color(rng() | 0xff000000, mode);
+
+    check("pack_native_colors/" + suffix, outcome([&] { return reference::pack_native_colors(colors, mode); }),
+          outcome([&] { return pack_native_colors(colors, mode); }), fmt::format("{} colors", count));
+
+    byte_vec_t native(bench::random_below(rng, 33));
+    for (auto& b : native)
+      b = (uint8_t)rng();
+    rgba_vec_t unsorted(colors);
+    for (auto& c : unsorted) {
+      // include transparent colors and near duplicates to exercise equal sort keys
+      if (bench::random_below(rng, 8) == 0)
+        c = rng() & 0x7fffffff;
+      else if (bench::random_below(rng, 4) == 0)
+        c = unsorted[bench::random_below(rng, count)] ^ (rng() & 0x01010101);
+    }
+    check("sort_colors/" + suffix, outcome([&] { return reference::sort_colors(unsorted); }), outcome([&] {
+            auto sorted = unsorted;
+            sort_colors(sorted);
+            return sorted;
+          }),
+          fmt::format("{} colors", count));
+
+    check("unpack_native_colors/" + suffix, outcome([&] { return reference::unpack_native_colors(native, mode); }),
+          outcome([&] { return unpack_native_colors(native, mode); }), hex(native));
+  }
+}
+
+void verify_mapentries(Mode mode, std::mt19937& rng) {
+  const std::string suffix = sfc::mode(mode);
+
+  for (unsigned i = 0; i < iterations; ++i) {
+    reference::Entry e;
+    e.tile_index = bench::random_below(rng, 2048);
+    e.palette_index = bench::random_below(rng, 16);
+    e.flip_h = rng() & 1;
+    e.flip_v = rng() & 1;
+
+    check("pack_native_mapentry/" + suffix, outcome([&] { return reference::pack_native_mapentry(e, mode); }),
+          outcome([&] { return pack_native_mapentry(Mapentry(e.tile_index, e.palette_index, e.flip_h, e.flip_v), mode); }),
+          fmt::format("tile={} palette={} h={} v={}", e.tile_index, e.palette_index, e.flip_h, e.flip_v));
+  }
+}
+
+// base offsets up to the map entry index limits, and the errors just beyond them
+void verify_map_limits() {
+  using Indices = std::pair<unsigned, unsigned>;
+  const auto offset = [](unsigned tile_index, unsigned palette_index, int tile_offset, int palette_offset) {
+    return outcome([&] {
+      Map map(Mode::snes, 1, 1);
+      map.add_base_offset((int)tile_index);
+      map.add_palette_base_offset((int)palette_index);
+      map.add_base_offset(tile_offset);
+      map.add_palette_base_offset(palette_offset);
+      const Mapentry e = map.entry_at(0, 0);
+      return Indices(e.tile_index, e.palette_index);
+    });
+  };
+  const auto input = [](unsigned tile_index, unsigned palette_index, int tile_offset, int palette_offset) {
+    return fmt::format("tile={}{:+} palette={}{:+}", tile_index, tile_offset, palette_index, palette_offset);
+  };
+
+  const unsigned max_tile = Map::max_tile_index;
+  const unsigned max_palette = Map::max_palette_index;
+  const std::vector<std::tuple<unsigned, unsigned, int, int, Outcome<Indices>>> cases = {
+    {0, 0, (int)max_tile, (int)max_palette, {{max_tile, max_palette}, ""}},
+    {max_tile, max_palette, -(int)max_tile, -(int)max_palette, {{0, 0}, ""}},
+    {16, 4, -32, -8, {{0, 0}, ""}},
+    {max_tile, 0, 1, 0, {{}, fmt::format("Tile base offset 1 puts tile index {} beyond limit of {}", max_tile + 1, max_tile)}},
+    {0, max_palette, 0, 1,
+     {{}, fmt::format("Palette base offset 1 puts palette index {} beyond limit of {}", max_palette + 1, max_palette)}},
+  };
+  for (const auto& [tile_index, palette_index, tile_offset, palette_offset, expected] : cases) {
+    check("map_limits", expected, offset(tile_index, palette_index, tile_offset, palette_offset),
+          input(tile_index, palette_index, tile_offset, palette_offset));
+  }
+}
+
+// color orders rearrange the colors they're given, frequency order puts more used colors first, and plane order
+// has no more bit plane transitions than the frequency order it starts from
+void verify_color_orders(std::mt19937& rng) {
+  for (unsigned i = 0; i < std::max(1u, iterations / 10); ++i) {
+    const unsigned count = 1 + bench::random_below(rng, bench::random_below(rng, 4) ? 15 : 255);
+    rgba_vec_t colors(count);
+    for (auto& c : colors)
+      c = bench::random_color(rng);
+
+    ColorUsage usage;
+    for (const rgba_t c : colors)
+      usage.pixels[c] = bench::random_below(rng, 64);
+    for (unsigned n = bench::random_below(rng, 4 * count); n > 0; --n) {
+      // neighbors include colors outside the subpalette, which are at index 0
+      const rgba_t a = colors[bench::random_below(rng, count)];
+      const rgba_t b = bench::random_below(rng, 8) ? colors[bench::random_below(rng, count)] : transparent_color;
+      if (a != b)
+        usage.neighbors[std::minmax(a, b)] += 1 + bench::random_below(rng, 16);
+    }
+
+    const auto transitions = [&](const rgba_vec_t& order) {
+      uint64_t sum = 0;
+      for (const auto& [pair, weight] : usage.neighbors) {
+        const auto a = std::find(order.begin(), order.end(), pair.first);
+        const auto b = std::find(order.begin(), order.end(), pair.second);
+        const unsigned ia = a == order.end() ? 0 : (unsigned)(a - order.begin()) + 1;
+        const unsigned ib = b == order.end() ? 0 : (unsigned)(b - order.begin()) + 1;
+        sum += (uint64_t)weight * std::popcount(ia ^ ib);
+      }
+      return sum;
+    };
+    const auto is_permutation = [&](const rgba_vec_t& order) {
+      return std::is_permutation(order.begin(), order.end(), colors.begin(), colors.end());
+    };
+
+    rgba_vec_t frequency = colors;
+    frequency_order(frequency, usage);
+    rgba_vec_t planes = colors;
+    plane_order(planes, usage);
+
+    const bool descending = std::is_sorted(frequency.begin(), frequency.end(), [&](rgba_t a, rgba_t b) {
+      return usage.pixels.at(a) > usage.pixels.at(b);
+    });
+    const std::string input = fmt::format("{} colors, {} neighbor pairs", count, usage.neighbors.size());
+    check("frequency_order", Outcome<bool>{true, ""}, Outcome<bool>{is_permutation(frequency) && descending, ""}, input);
+    check("plane_order", Outcome<bool>{true, ""},
+          Outcome<bool>{is_permutation(planes) && transitions(planes) <= transitions(frequency), ""}, input);
+  }
+}
+
+void verify_palettes(Mode mode, std::mt19937& rng) {
+  const std::string name = "optimized_palettes/" + sfc::mode(mode);
+  const unsigned bpp = default_bpp_for_mode(mode);
+  const unsigned tile_size = default_tile_size_for_mode(mode);
+
+  // palette optimization is comparatively slow, run a fraction of the iterations
+  for (unsigned i = 0; i < std::max(1u, iterations / 50); ++i) {
+    bench::SyntheticSpec spec;
+    spec.width = tile_size * (1 + bench::random_below(rng, 8));
+    spec.height = tile_size * (1 + bench::random_below(rng, 8));
+    spec.tile_width = spec.tile_height = tile_size;
+    spec.duplicate_fraction = bench::random_unit(rng) * 0.5f;
+    spec.flipped_fraction = bench::random_unit(rng) * 0.5f;
+    spec.colors_per_tile = 1 + bench::random_below(rng, palette_size_at_bpp(bpp));
+    spec.color_sets = 1 + bench::random_below(rng, 8);
+    spec.seed = rng();
+
+    const Image image(bench::synthetic_image(spec), spec.width, spec.height);
+    const auto crops = image.crops(spec.tile_width, spec.tile_height, mode);
+    const unsigned max_subpalettes = default_palette_count_for_mode(mode);
+    const unsigned max_colors = palette_size_at_bpp(bpp);
+    const bool shared = col0_is_shared_for_mode(mode);
+    const rgba_t col0 = image.rgba_color_at(0);
+
+    const auto expected = outcome([&] {
+      if (!shared)
+        return reference::palette_colors(crops, mode, max_subpalettes, max_colors);
+      // mirror Palette::prime_col0()
+      const rgba_t c = reduce_color(col0, mode) == transparent_color ? transparent_color : col0;
+      return reference::palette_colors(crops, mode, max_subpalettes, max_colors, &c);
+    });
+
+    const auto actual = outcome([&] {
+      Palette palette(mode, max_subpalettes, max_colors);
+      if (shared)
+        palette.prime_col0(col0);
+      palette.add_images(crops);
+      return palette.colors();
+    });
+
+    check(name, expected, actual,
+          fmt::format("{}x{} colors={} sets={} seed={}", spec.width, spec.height, spec.colors_per_tile, spec.color_sets, spec.seed));
+  }
+}
+
+// tile grid statistics, matching and remapping against the same done on image crops
+// grids are sliced whole and in two bands sharing crop ids (numbered alike), from images with partial tiles at the edges
+void verify_tile_grids(Mode mode, std::mt19937& rng) {
+  const std::string suffix = sfc::mode(mode);
+  const unsigned bpp = default_bpp_for_mode(mode);
+  const unsigned tile_size = default_tile_size_for_mode(mode);
+
+  for (unsigned i = 0; i < std::max(1u, iterations / 50); ++i) {
+    bench::SyntheticSpec spec;
+    spec.width = tile_size * (1 + bench::random_below(rng, 8));
+    spec.height = tile_size * (2 + bench::random_below(rng, 8));
+    spec.tile_width = spec.tile_height = tile_size;
+    spec.duplicate_fraction = bench::random_unit(rng) * 0.5f;
+    spec.colors_per_tile = 1 + bench::random_below(rng, palette_size_at_bpp(bpp));
+    spec.color_sets = 1 + bench::random_below(rng, 8);
+    spec.seed = rng();
+
+    const unsigned width = spec.width - bench::random_below(rng, tile_size);
+    const unsigned height = spec.height - bench::random_below(rng, tile_size);
+    const Image image = Image(bench::synthetic_image(spec), spec.width, spec.height).crop(0, 0, width, height, mode);
+    const auto crops = image.crops(tile_size, tile_size, mode);
+    // partial tiles add a fill color, leave room for it
+    Palette palette(mode, std::max(1u, default_palette_count_for_mode(mode)), palette_size_at_bpp(8));
+    try {
+      palette.add_images(crops);
+    } catch (const std::exception&) {
+      // tiles without a matching subpalette are checked to fail alike
+    }
+
+    const TileGrid grid(image, tile_size, tile_size, mode);
+    CropIndex index;
+    const unsigned band_rows = grid.rows() / 2;
+    const TileGrid first_band(image, tile_size, tile_size, mode, 0, band_rows, index);
+    const TileGrid second_band(image, tile_size, tile_size, mode, band_rows, grid.rows() - band_rows, index);
+
+    const std::string input =
+      fmt::format("{}x{} colors={} sets={} seed={}", width, height, spec.colors_per_tile, spec.color_sets, spec.seed);
+    check("TileGrid::size/" + suffix, Outcome<size_t>{crops.size(), ""},
+          Outcome<size_t>{grid.size() == first_band.size() + second_band.size() ? grid.size() : 0, ""}, input);
+    if (grid.size() != crops.size())
+      continue;
+
+    for (unsigned t = 0; t < crops.size(); ++t) {
+      const Image& crop = crops[t];
+      const auto expected = outcome([&] {
+        unsigned first = 0;
+        while (crops[first].rgba_data() != crop.rgba_data() || crops[first].indexed_data() != crop.indexed_data())
+          ++first;
+        rgba_vec_t pixels(crop.width() * crop.height());
+        for (unsigned p = 0; p < pixels.size(); ++p)
+          pixels[p] = reduce_color(crop.rgba_color_at(p), mode);
+        const auto reduced = reduce_colors(crop.colors(), mode);
+        const Subpalette& sp = palette.subpalette_matching(crop);
+        return fmt::format("{} {} {} {} {} {} {}", CropIndex::hash(crop), crop.color_count(), first,
+                           fmt::join(reduced, ","), fmt::join(pixels, ","),
+                           palette.index_of(sp), fmt::join(Image(crop, sp, true).indexed_data(), ","));
+      });
+      const auto actual = outcome([&] {
+        const auto reduced = grid.reduced_colors(t);
+        rgba_vec_t pixels(grid.tile_width() * grid.tile_height());
+        for (unsigned p = 0; p < pixels.size(); ++p)
+          pixels[p] = grid.reduced_color_at(t, p);
+        const Subpalette& sp = palette.subpalette_matching(grid, t);
+        index_vec_t remapped(pixels.size());
+        grid.remap(t, sp, remapped.data());
+        return fmt::format("{} {} {} {} {} {} {}", grid.hash(t), grid.color_count(t), grid.first_identical(t),
+                           fmt::join(reduced, ","), fmt::join(pixels, ","),
+                           palette.index_of(sp), fmt::join(remapped, ","));
+      });
+      check("TileGrid/" + suffix, expected, actual, fmt::format("{} tile={}", input, t));
+
+      const TileGrid& band = t < first_band.size() ? first_band : second_band;
+      const unsigned band_index = t < first_band.size() ? t : t - first_band.size();
+      check("TileGrid::id/" + suffix, Outcome<unsigned>{grid.id(t), ""}, Outcome<unsigned>{band.id(band_index), ""},
+            fmt::format("{} tile={}", input, t));
+    }
+  }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--iterations" && i + 1 < argc) {
+      iterations = (unsigned)std::atoi(argv[++i]);
+    } else if (arg == "--seed" && i + 1 < argc) {
+      seed = (unsigned)std::atoi(argv[++i]);
+    } else {
+      fmt::print("Usage: sfc_verify [--iterations <count>] [--seed <seed>]\n");
+      return arg == "-h" || arg == "--help" ? 0 : 1;
+    }
+  }
+
+  std::mt19937 rng(seed);
+  for (auto mode : all_modes) {
+    verify_tiles(mode, rng);
+    verify_colors(mode, rng);
+    verify_mapentries(mode, rng);
+    verify_palettes(mode, rng);
+    verify_tile_grids(mode, rng);
+  }
+  verify_map_limits();
+  verify_color_orders(rng);
+
+  fmt::print("{} checks, {} mismatches\n", checks, failures);
+  return failures ? 1 : 0;
+}
@@ -4,6 +4,10 @@
 
 #pragma once
 
+#include <functional>
+#include <map>
+#include <unordered_map>
+
 #include "Common.h"
 
 namespace sfc {
@@ -183,27 +187,44 @@ inline hsva_color::operator rgba_color() {
   return rgba;
 }
 
-// aesthetically pleasing color sorting
-inline bool rgba_color::operator>(const rgba_color& o) const {
+// aesthetically pleasing color sorting key, hue/luminance/value segments packed to compare as one integer
+inline uint64_t hue_sort_key(const rgba_color& c) {
   const int segments = 8;
-  hsva_color hsva = hsva_color(*this);
-  hsva_color hsva_o = hsva_color(o);
+  hsva_color hsva = hsva_color(c);
 
-  int h = (int)(segments * hsva.h);
-  // int l = (int)(segments * hsva.s);
-  int l = (int)(segments * sqrt(0.241f * r + 0.691f * g + 0.068f * b));
-  int v = (int)(segments * hsva.v);
+  uint64_t h = (unsigned)(int)(segments * hsva.h);
+  // uint64_t l = (unsigned)(int)(segments * hsva.s);
+  uint64_t l = (unsigned)(int)(segments * sqrt(0.241f * c.r + 0.691f * c.g + 0.068f * c.b));
+  uint64_t v = (unsigned)(int)(segments * hsva.v);
 
-  int ho = (int)(segments * hsva_o.h);
-  // int lo = (int)(segments * hsva_o.s);
-  int lo = (int)(segments * sqrt(0.241f * o.r + 0.691f * o.g + 0.068f * o.b));
-  int vo = (int)(segments * hsva_o.v);
+  return (h << 40) | (l << 20) | v;
+}
 
-  return std::tie(h, l, v) > std::tie(ho, lo, vo);
+inline bool rgba_color::operator>(const rgba_color& o) const {
+  return hue_sort_key(*this) > hue_sort_key(o);
 }
 
+// sort colors by descending hue order key, computing each key once
 inline void sort_colors(rgba_vec_t& colors) {
-  std::sort(colors.begin(), colors.end(), [](const rgba_t& a, const rgba_t& b) -> bool { return rgba_color(a) > rgba_color(b); });
+  std::vector<std::pair<uint64_t, rgba_t>> keyed(colors.size());
+  for (size_t i = 0; i < colors.size(); ++i)
+    keyed[i] = {hue_sort_key(rgba_color(colors[i])), colors[i]};
+
+  std::sort(keyed.begin(), keyed.end(), [](const auto& a, const auto& b) -> bool { return a.first > b.first; });
+
+  for (size_t i = 0; i < colors.size(); ++i)
+    colors[i] = keyed[i].second;
 }
 
+// how the tiles remapped to a subpalette use its colors
+struct ColorUsage final {
+  // pixels of each color
+  std::unordered_map<rgba_t, unsigned> pixels;
+  // horizontally or vertically adjacent pixels of each pair of distinct colors, lower color first
+  std::map<std::pair<rgba_t, rgba_t>, unsigned> neighbors;
+};
+
+// color ordering strategy, arranging the colors of a subpalette following color 0 in index order
+typedef std::function<void(rgba_vec_t& colors, const ColorUsage& usage)> color_order_t;
+
 } /* namespace sfc */
@@ -4,8 +4,13 @@
 
 #pragma once
 
+#include <atomic>
 #include <cstdint>
+#include <filesystem>
 #include <fstream>
+#include <memory_resource>
+#include <new>
+#include <random>
 #include <set>
 #include <nlohmann/json.hpp>
 #include <fmt/core.h>
@@ -25,8 +30,39 @@ namespace sfc {
 
 enum Constants {
   options_indent = 28,
+  pipeline_band_tiles = 1024, // tiles per band handed between pipelined stages
+  pipeline_depth = 2,         // bands pending between pipelined stages
 };
 
+// allocator-aware container types for transient data, allocated from an Arena
+namespace pmr {
+typedef std::pmr::vector<uint8_t> byte_vec_t;
+typedef std::pmr::vector<index_t> index_vec_t;
+typedef std::pmr::vector<channel_t> channel_vec_t;
+typedef std::pmr::vector<rgba_t> rgba_vec_t;
+typedef std::pmr::set<rgba_t> rgba_set_t;
+typedef std::pmr::vector<pmr::rgba_set_t> rgba_set_vec_t;
+} // namespace pmr
+
+// monotonic arena for transient data of a conversion stage, released in one shot when destroyed
+// not thread safe, use one arena per thread
+struct Arena final {
+  Arena(size_t initial_size = 1 << 16) : _resource(initial_size) {}
+
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  std::pmr::memory_resource* resource() { return &_resource; }
+
+private:
+  std::pmr::monotonic_buffer_resource _resource;
+};
+
+// rows of tiles per pipeline band for an image columns tiles wide
+constexpr unsigned pipeline_band_rows(unsigned columns) {
+  return columns == 0 || columns >= pipeline_band_tiles ? 1 : pipeline_band_tiles / columns;
+}
+
 constexpr unsigned palette_size_at_bpp(unsigned bpp) {
   unsigned s = 1;
   for (unsigned i = 0; i < bpp; ++i)
@@ -85,17 +121,78 @@ inline byte_vec_t read_binary(const std::string& path) {
   return byte_vec_t((std::istreambuf_iterator<char>(ifs)), (std::istreambuf_iterator<char>()));
 }
 
+// output file written through a temporary file next to path, renamed over path on commit
+// readers never see partially written output, and the temporary is removed if not committed
+struct OutputFile final {
+  OutputFile(const std::string& path, bool binary = true) : _path(path) {
+    // devices and pipes can't be replaced, write those directly
+    std::error_code ec;
+    const auto status = std::filesystem::status(path, ec);
+    _direct = std::filesystem::exists(status) && !std::filesystem::is_regular_file(status);
+
+    if (_direct) {
+      _temp_path = path;
+    } else {
+      // random per-process token keeps concurrent processes writing the same path apart, serial keeps threads apart
+      static const uint64_t token = ((uint64_t)std::random_device{}() << 32) | std::random_device{}();
+      static std::atomic<unsigned> serial = 0;
+      do {
+        _temp_path = fmt::format("{}.{:016x}.{}.tmp", path, token, serial++);
+      } while (std::filesystem::exists(_temp_path, ec));
+    }
+    _stream.open(_temp_path, std::ios::out | std::ios::trunc | (binary ? std::ios::binary : std::ios::openmode()));
+    if (_stream.fail())
+      throw std::runtime_error(fmt::format("File \"{}\" could not be opened for writing", path));
+  }
+
+  // an uncommitted temp file, left by an exception while writing or a failed commit, is removed
+  ~OutputFile() {
+    if (_committed || _direct)
+      return;
+    _stream.close();
+    std::error_code ec;
+    std::filesystem::remove(_temp_path, ec);
+  }
+
+  OutputFile(const OutputFile&) = delete;
+  OutputFile& operator=(const OutputFile&) = delete;
+
+  std::ostream& stream() { return _stream; }
+
+  void commit() {
+    _stream.close();
+    if (_stream.fail())
+      throw std::runtime_error(fmt::format("File \"{}\" could not be written", _path));
+    if (!_direct) {
+      std::error_code ec;
+      std::filesystem::rename(_temp_path, _path, ec);
+      if (ec)
+        throw std::runtime_error(fmt::format("File \"{}\" could not be written ({})", _path, ec.message()));
+    }
+    _committed = true;
+  }
+
+private:
+  std::string _path;
+  std::string _temp_path;
+  std::ofstream _stream;
+  bool _direct = false;
+  bool _committed = false;
+};
+
 // write text file
 inline void write_file(const std::string& path, const std::string& contents) {
-  std::ofstream ofs(path, std::ofstream::out | std::ofstream::trunc);
-  ofs << contents;
+  OutputFile file(path, false);
+  file.stream() << contents;
+  file.commit();
 }
 
-// write binary file
+// write binary file in a single write
 template <typename T>
 inline void write_file(const std::string& path, const std::vector<T>& data) {
-  std::ofstream ofs(path, std::ios::out | std::ofstream::trunc | std::ios::binary);
-  ofs.write(reinterpret_cast<const char*>(&data[0]), data.size() * sizeof(T));
+  OutputFile file(path);
+  file.stream().write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(T));
+  file.commit();
 }
 
 //
@@ -118,6 +215,42 @@ constexpr double deg2rad(const double deg) {
   return deg * (M_PI / 180.0);
 }
 
+// 64-bit FNV-1a hash
+inline uint64_t fnv1a(const uint8_t* data, size_t size, uint64_t hash = 0xcbf29ce484222325) {
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= data[i];
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+// process-wide unique serial, identifying object states in caches that may outlive the objects
+inline uint64_t unique_serial() {
+  static std::atomic<uint64_t> serial = 0;
+  return ++serial;
+}
+
+// allocator for storage aligned to Alignment bytes (eg. cache lines)
+template <typename T, size_t Alignment>
+struct aligned_allocator {
+  using value_type = T;
+
+  template <typename U>
+  struct rebind {
+    using other = aligned_allocator<U, Alignment>;
+  };
+
+  aligned_allocator() = default;
+  template <typename U>
+  aligned_allocator(const aligned_allocator<U, Alignment>&) {}
+
+  T* allocate(size_t n) { return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment))); }
+  void deallocate(T* p, size_t) { ::operator delete(p, std::align_val_t(Alignment)); }
+
+  template <typename U>
+  bool operator==(const aligned_allocator<U, Alignment>&) const { return true; }
+};
+
 template <typename T>
 std::vector<T> split_vector(const T& vect, unsigned split_size) {
   std::vector<T> sv;
@@ -135,22 +268,22 @@ std::vector<T> split_vector(const T& vect, unsigned split_size) {
   return sv;
 }
 
-template <typename T>
-T vec_pop(std::vector<T>& v) {
+template <typename V>
+typename V::value_type vec_pop(V& v) {
   if (!v.size())
     throw std::range_error("vector empty");
-  T e = v.back();
+  typename V::value_type e = std::move(v.back());
   v.pop_back();
   return e;
 }
 
-template <typename T>
-bool is_subset(const std::set<T>& set, const std::set<T>& superset) {
+template <typename S>
+bool is_subset(const S& set, const S& superset) {
   return std::includes(superset.begin(), superset.end(), set.begin(), set.end());
 }
 
-template <typename T>
-bool has_superset(const std::set<T>& set, const std::vector<std::set<T>>& super) {
+template <typename S, typename V>
+bool has_superset(const S& set, const V& super) {
   for (auto& cmp_set : super) {
     if (cmp_set == set)
       continue;
@@ -0,0 +1,68 @@
+#include "CropIndex.h"
+#include "Image.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace sfc {
+
+namespace {
+
+// hash of pixel data, mixing a word at a time
+uint64_t pixel_hash(const uint8_t* bytes, size_t size, uint64_t hash) {
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, bytes + i, 8);
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15;
+    hash ^= hash >> 29;
+  }
+  return fnv1a(bytes + i, size - i, hash);
+}
+
+} // namespace
+
+uint64_t CropIndex::hash(const Image& crop) {
+  const bool indexed = !crop._indexed_data.empty();
+  uint64_t h = hash_seed;
+  for (unsigned y = 0; y < crop._height; ++y) {
+    h = hash_row(&crop._data[(size_t)y * crop._width * 4], indexed ? &crop._indexed_data[(size_t)y * crop._width] : nullptr,
+                 crop._width, h);
+  }
+  return h;
+}
+
+uint64_t CropIndex::hash_row(const channel_t* pixels, const index_t* indexed_pixels, unsigned width, uint64_t hash) {
+  hash = pixel_hash(pixels, (size_t)width * 4, hash);
+  return indexed_pixels ? pixel_hash(indexed_pixels, width, hash) : hash;
+}
+
+std::pair<unsigned, bool> CropIndex::insert(unsigned width, unsigned height, const channel_t* pixels,
+                                            const index_t* indexed_pixels, uint64_t hash) {
+  auto range = _index.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (equals(it->second, width, height, pixels, indexed_pixels))
+      return {it->second, false};
+  }
+
+  const size_t size = (size_t)width * height;
+  const unsigned id = (unsigned)_entries.size();
+  _entries.push_back({width, height, _pixels.size(), _indexed_pixels.size(), indexed_pixels != nullptr});
+  _pixels.insert(_pixels.end(), pixels, pixels + size * 4);
+  if (indexed_pixels)
+    _indexed_pixels.insert(_indexed_pixels.end(), indexed_pixels, indexed_pixels + size);
+  _index.emplace(hash, id);
+  return {id, true};
+}
+
+bool CropIndex::equals(unsigned id, unsigned width, unsigned height, const channel_t* pixels,
+                       const index_t* indexed_pixels) const {
+  const Entry& entry = _entries[id];
+  const size_t size = (size_t)width * height;
+  if (entry.width != width || entry.height != height || entry.indexed != (indexed_pixels != nullptr))
+    return false;
+  return std::memcmp(&_pixels[entry.offset], pixels, size * 4) == 0 &&
+         (!indexed_pixels || std::memcmp(&_indexed_pixels[entry.indexed_offset], indexed_pixels, size) == 0);
+}
+
+} /* namespace sfc */
@@ -0,0 +1,56 @@
+// dictionary of source image crops
+//
+// david lindecrantz <optiroc@me.com>
+
+#pragma once
+
+#include <unordered_map>
+#include <utility>
+
+#include "Common.h"
+
+namespace sfc {
+
+struct Image;
+
+// dictionary of raw crop contents, giving each distinct crop an id in order of first occurrence
+// pixel data of distinct crops is kept to compare against, so ids never collide
+// tile grids share ids through an index (see TileGrid)
+struct CropIndex final {
+  static constexpr uint64_t hash_seed = 0xcbf29ce484222325;
+
+  // hash of raw rgba and indexed pixel data
+  static uint64_t hash(const Image& crop);
+
+  // hash of one row of width pixels continuing hash, so a crop can be hashed as it's copied (indexed_pixels may be null)
+  static uint64_t hash_row(const channel_t* pixels, const index_t* indexed_pixels, unsigned width, uint64_t hash);
+
+  // id of first crop with pixel data identical to the given crop and false, or a new id and true if it was added
+  // pixels hold width * height rgba pixels and indexed_pixels as many indices (or null for crops of an rgba image)
+  std::pair<unsigned, bool> insert(unsigned width, unsigned height, const channel_t* pixels, const index_t* indexed_pixels,
+                                   uint64_t hash);
+
+  unsigned size() const { return (unsigned)_entries.size(); }
+
+  // identifies the id space of this index
+  uint64_t generation() const { return _generation; }
+
+private:
+  struct Entry {
+    unsigned width;
+    unsigned height;
+    size_t offset;
+    size_t indexed_offset;
+    bool indexed;
+  };
+
+  uint64_t _generation = unique_serial();
+  std::unordered_multimap<uint64_t, unsigned> _index;
+  std::vector<Entry> _entries;
+  channel_vec_t _pixels;
+  index_vec_t _indexed_pixels;
+
+  bool equals(unsigned id, unsigned width, unsigned height, const channel_t* pixels, const index_t* indexed_pixels) const;
+};
+
+} /* namespace sfc */
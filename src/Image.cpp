@@ -1,20 +1,85 @@
 #include "Image.h"
+#include "CropIndex.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <limits>
+#include <unordered_map>
 
 namespace sfc {
 
+namespace {
+
+// read color stored as r, g, b, a channel bytes
+inline rgba_t load_color(const channel_t* src) {
+  return src[0] + (src[1] << 8) + (src[2] << 16) + ((rgba_t)src[3] << 24);
+}
+
+// unique colors of size pixels of rgba channel data in ascending order
+// tiles typically hold few colors, which are gathered with a linear scan before falling back to sorting all pixels
+template <typename Allocator>
+void unique_colors(const channel_t* data, size_t size, std::vector<rgba_t, Allocator>& colors) {
+  constexpr unsigned scan_limit = 16;
+  colors.clear();
+  for (size_t i = 0; i < size; ++i) {
+    const rgba_t color = load_color(&data[i * 4]);
+    if (std::find(colors.begin(), colors.end(), color) != colors.end())
+      continue;
+    if (colors.size() == scan_limit) {
+      colors.resize(size);
+      for (size_t j = 0; j < size; ++j)
+        colors[j] = load_color(&data[j * 4]);
+      std::sort(colors.begin(), colors.end());
+      colors.erase(std::unique(colors.begin(), colors.end()), colors.end());
+      return;
+    }
+    colors.push_back(color);
+  }
+  std::sort(colors.begin(), colors.end());
+}
+
+// set of unique colors, built from an ordered run in linear time
+rgba_set_t unique_colors(const channel_vec_t& data) {
+  rgba_vec_t colors;
+  unique_colors(data.data(), data.size() / 4, colors);
+  return rgba_set_t(colors.begin(), colors.end());
+}
+
+// write color as r, g, b, a channel bytes, independent of host byte order
+inline void store_color(channel_t* dest, rgba_t color) {
+  dest[0] = (channel_t)(color & 0xff);
+  dest[1] = (channel_t)((color >> 8) & 0xff);
+  dest[2] = (channel_t)((color >> 16) & 0xff);
+  dest[3] = (channel_t)((color >> 24) & 0xff);
+}
+
+} // namespace
+
 Image::Image(const std::string& path) {
+  SFC_TRACE_SPAN("decode image", path);
   byte_vec_t buffer;
-  unsigned w, h;
 
   unsigned error = lodepng::load_file(buffer, path);
   if (error)
     throw std::runtime_error(lodepng_error_text(error));
 
+  decode(buffer);
+}
+
+Image::Image(const byte_vec_t& png_data) {
+  decode(png_data);
+}
+
+void Image::decode(const byte_vec_t& buffer) {
+  unsigned w, h;
+
   lodepng::State state;
   state.decoder.color_convert = false;
   state.decoder.ignore_crc = true;
 
-  error = lodepng::decode(_data, w, h, state, buffer);
+  unsigned error = lodepng::decode(_data, w, h, state, buffer);
   if (error)
     throw std::runtime_error(lodepng_error_text(error));
 
@@ -73,8 +138,16 @@ Image::Image(const std::string& path) {
 
   _src_coord_x = _src_coord_y = 0;
 
-  auto rgba_v = rgba_data();
-  _colors = rgba_set_t(rgba_v.begin(), rgba_v.end());
+  _colors = unique_colors(_data);
+}
+
+Image::Image(const rgba_vec_t& rgba_data, unsigned width, unsigned height) : _width(width), _height(height) {
+  if (rgba_data.size() != (size_t)width * height)
+    throw std::runtime_error("Image data size doesn't match dimensions");
+
+  _data = to_bytes(rgba_data);
+  _src_coord_x = _src_coord_y = 0;
+  _colors = unique_colors(_data);
 }
 
 Image::Image(const sfc::Palette& palette) {
@@ -95,8 +168,7 @@ Image::Image(const sfc::Palette& palette) {
 
   _src_coord_x = _src_coord_y = 0;
 
-  auto rgba_v = rgba_data();
-  _colors = rgba_set_t(rgba_v.begin(), rgba_v.end());
+  _colors = unique_colors(_data);
 }
 
 Image::Image(const sfc::Tileset& tileset, unsigned image_width) {
@@ -118,7 +190,7 @@ Image::Image(const sfc::Tileset& tileset, unsigned image_width) {
   if (_data.empty())
     return;
 
-  _palette = tileset.tiles()[0].palette();
+  _palette = tiles[0].palette();
 
   for (unsigned tile_index = 0; tile_index < tiles.size(); ++tile_index) {
     auto tile_rgba = tiles[tile_index].rgba_data();
@@ -129,40 +201,47 @@ Image::Image(const sfc::Tileset& tileset, unsigned image_width) {
 
   _src_coord_x = _src_coord_y = 0;
 
-  auto rgba_v = rgba_data();
-  _colors = rgba_set_t(rgba_v.begin(), rgba_v.end());
+  _colors = unique_colors(_data);
 }
 
 // Make new normalized image with color indices mapped to palette
-Image::Image(const Image& image, const sfc::Subpalette& subpalette)
+Image::Image(const Image& image, const sfc::Subpalette& subpalette, bool indexed_only)
     : _width(image.width()), _height(image.height()), _palette(subpalette.normalized_colors()) {
   if (_palette.empty())
     throw std::runtime_error("No colors");
 
   unsigned size = _width * _height;
   _indexed_data.resize(size);
-  _data.resize(size * 4);
+  if (!indexed_only)
+    _data.resize(size * 4);
+
+  // source pixels mostly repeat, so only look up colors that differ from the previous pixel
+  rgba_t source_color = 0;
+  rgba_t color = 0;
+  index_t index = 0;
 
   for (unsigned i = 0; i < size; ++i) {
-    rgba_t color = sfc::normalize_color(sfc::reduce_color(image.rgba_color_at(i), subpalette.mode()), subpalette.mode());
-    if (color == transparent_color) {
-      _indexed_data[i] = 0;
-      set_pixel(transparent_color, i);
-    } else {
-      size_t palette_index = std::find(_palette.begin(), _palette.end(), color) - _palette.begin();
-      if (palette_index < _palette.size()) {
-        _indexed_data[i] = (index_t)palette_index;
-        set_pixel(sfc::rgba_color(_palette[palette_index]), i);
+    if (i == 0 || image.rgba_color_at(i) != source_color) {
+      source_color = image.rgba_color_at(i);
+      color = sfc::normalize_color(sfc::reduce_color(source_color, subpalette.mode()), subpalette.mode());
+      if (color == transparent_color) {
+        index = 0;
       } else {
-        throw std::runtime_error("Color not in palette");
+        int palette_index = subpalette.index_of(color);
+        if (palette_index < 0)
+          throw std::runtime_error("Color not in palette");
+        index = (index_t)palette_index;
       }
+      if (!indexed_only)
+        _colors.insert(color);
     }
+
+    _indexed_data[i] = index;
+    if (!indexed_only)
+      store_color(&_data[i * 4], color);
   }
 
   _src_coord_x = _src_coord_y = 0;
-
-  auto rgba_v = rgba_data();
-  _colors = rgba_set_t(rgba_v.begin(), rgba_v.end());
 }
 
 rgba_vec_t Image::rgba_data() const {
@@ -178,10 +257,10 @@ Image Image::crop(unsigned x, unsigned y, unsigned crop_width, unsigned crop_hei
   img._src_coord_y = y;
   img._data.resize(crop_width * crop_height * 4);
 
-  uint32_t fillval = mode == Mode::gb ? 0xff000000 : transparent_color;
+  rgba_t fillval = mode == Mode::gb ? 0xff000000 : transparent_color;
   size_t fillsize = img._data.size();
   for (size_t i = 0; i < fillsize; i += 4)
-    std::memcpy(img._data.data() + i, &fillval, sizeof(fillval));
+    store_color(img._data.data() + i, fillval);
 
   if (x > _width || y > _height) {
     // Crop outside source image: return empty
@@ -204,16 +283,21 @@ Image Image::crop(unsigned x, unsigned y, unsigned crop_width, unsigned crop_hei
     }
   }
 
-  auto rgba_v = img.rgba_data();
-  img._colors = rgba_set_t(rgba_v.begin(), rgba_v.end());
+  img._colors = unique_colors(img._data);
   return img;
 }
 
 std::vector<Image> Image::crops(unsigned tile_width, unsigned tile_height, Mode mode) const {
+  return crops(tile_width, tile_height, mode, 0, div_ceil(_height, tile_height));
+}
+
+std::vector<Image> Image::crops(unsigned tile_width, unsigned tile_height, Mode mode, unsigned first_row, unsigned row_count) const {
   std::vector<Image> v;
+  v.reserve((size_t)div_ceil(_width, tile_width) * row_count);
   unsigned x = 0;
-  unsigned y = 0;
-  while (y < _height) {
+  unsigned y = first_row * tile_height;
+  const unsigned end_y = std::min(_height, (first_row + row_count) * tile_height);
+  while (y < end_y) {
     while (x < _width) {
       v.push_back(crop(x, y, tile_width, tile_height, mode));
       x += tile_width;
@@ -224,10 +308,162 @@ std::vector<Image> Image::crops(unsigned tile_width, unsigned tile_height, Mode
   return v;
 }
 
+TileGrid::TileGrid(const Image& image, unsigned tile_width, unsigned tile_height, Mode mode)
+    : _mode(mode), _tile_width(tile_width), _tile_height(tile_height) {
+  CropIndex crops;
+  slice(image, 0, div_ceil(image.height(), tile_height), crops);
+}
+
+TileGrid::TileGrid(const Image& image, unsigned tile_width, unsigned tile_height, Mode mode, unsigned first_row,
+                   unsigned row_count, CropIndex& crops)
+    : _mode(mode), _tile_width(tile_width), _tile_height(tile_height) {
+  slice(image, first_row, row_count, crops);
+}
+
+// crop, hash and identify tiles, measuring only the first occurrence of each distinct tile
+// tiles are copied and hashed a row at a time into a scratch crop, so repeats cost one pass over their pixels
+void TileGrid::slice(const Image& image, unsigned first_row, unsigned row_count, CropIndex& crops) {
+  SFC_TRACE_SPAN("slice tiles");
+  const unsigned end_row = std::min(first_row + row_count, (unsigned)div_ceil(image.height(), _tile_height));
+  _columns = div_ceil(image.width(), _tile_width);
+  _rows = end_row > first_row ? end_row - first_row : 0;
+  _generation = crops.generation();
+
+  const size_t tile_size = (size_t)_tile_width * _tile_height;
+  if (tile_size > (size_t)std::numeric_limits<color_id_t>::max() + 1)
+    throw std::runtime_error(fmt::format("Tile size {}x{} too large", _tile_width, _tile_height));
+
+  const bool indexed = !image._indexed_data.empty();
+  if (indexed)
+    _palette = std::make_shared<const rgba_vec_t>(image._palette);
+
+  const size_t count = (size_t)_columns * _rows;
+  _x.reserve(count);
+  _y.reserve(count);
+  _first_identical.reserve(count);
+  _ids.reserve(count);
+  _hashes.reserve(count);
+  _color_counts.reserve(count);
+  _flags.reserve(count);
+  _slots.reserve(count);
+  _color_offsets.push_back(0);
+
+  // scratch crop and per tile temporaries, released with the slice
+  Arena scratch;
+  const rgba_t fill = _mode == Mode::gb ? 0xff000000 : transparent_color;
+  pmr::channel_vec_t pixels(tile_size * 4, scratch.resource());
+  pmr::index_vec_t indexed_pixels(indexed ? tile_size : 0, scratch.resource());
+  pmr::rgba_vec_t colors(scratch.resource());
+  pmr::rgba_vec_t reduced(scratch.resource());
+  std::pmr::vector<color_id_t> reduced_ids(scratch.resource());
+
+  // crop id -> first tile with that id in this grid
+  std::pmr::unordered_map<unsigned, unsigned> first_of_id(scratch.resource());
+
+  for (unsigned row = first_row; row < end_row; ++row) {
+    for (unsigned column = 0; column < _columns; ++column) {
+      const unsigned i = (unsigned)_x.size();
+      const unsigned x = column * _tile_width;
+      const unsigned y = row * _tile_height;
+      const unsigned blit_width = std::min(_tile_width, image._width - x);
+
+      // copy and hash crop as Image::crop() would produce it
+      uint64_t hash = CropIndex::hash_seed;
+      for (unsigned iy = 0; iy < _tile_height; ++iy) {
+        channel_t* dest = &pixels[(size_t)iy * _tile_width * 4];
+        index_t* indexed_dest = indexed ? &indexed_pixels[(size_t)iy * _tile_width] : nullptr;
+        const unsigned width = y + iy < image._height ? blit_width : 0;
+        if (width) {
+          const size_t offset = (size_t)(y + iy) * image._width + x;
+          std::memcpy(dest, &image._data[offset * 4], (size_t)width * 4);
+          if (indexed)
+            std::memcpy(indexed_dest, &image._indexed_data[offset], width);
+        }
+        for (unsigned ix = width; ix < _tile_width; ++ix)
+          store_color(&dest[ix * 4], fill);
+        if (indexed)
+          std::fill(indexed_dest + width, indexed_dest + _tile_width, 0);
+        hash = CropIndex::hash_row(dest, indexed_dest, _tile_width, hash);
+      }
+
+      const unsigned id =
+        crops.insert(_tile_width, _tile_height, pixels.data(), indexed ? indexed_pixels.data() : nullptr, hash).first;
+      const auto [first, first_occurrence] = first_of_id.try_emplace(id, i);
+      _x.push_back(x);
+      _y.push_back(y);
+      _ids.push_back(id);
+      _hashes.push_back(hash);
+      _first_identical.push_back(first->second);
+
+      if (!first_occurrence) {
+        _color_counts.push_back(_color_counts[first->second]);
+        _flags.push_back(_flags[first->second]);
+        _slots.push_back(_slots[first->second]);
+        continue;
+      }
+
+      // reduced colors, with the id of each unique color's reduced color
+      unique_colors(pixels.data(), tile_size, colors);
+      reduced.resize(colors.size());
+      for (size_t c = 0; c < colors.size(); ++c)
+        reduced[c] = reduce_color(colors[c], _mode);
+      std::sort(reduced.begin(), reduced.end());
+      reduced.erase(std::unique(reduced.begin(), reduced.end()), reduced.end());
+      reduced_ids.resize(colors.size());
+      for (size_t c = 0; c < colors.size(); ++c)
+        reduced_ids[c] = (color_id_t)(std::lower_bound(reduced.begin(), reduced.end(), reduce_color(colors[c], _mode)) -
+                                      reduced.begin());
+
+      _slots.push_back((unsigned)_color_offsets.size() - 1);
+      _reduced_colors.insert(_reduced_colors.end(), reduced.begin(), reduced.end());
+      _color_offsets.push_back((unsigned)_reduced_colors.size());
+      _color_counts.push_back((unsigned)colors.size());
+
+      // source pixels mostly repeat, so only look up colors that differ from the previous pixel
+      rgba_t previous = 0;
+      color_id_t color_id = 0;
+      for (size_t p = 0; p < tile_size; ++p) {
+        const rgba_t color = load_color(&pixels[p * 4]);
+        if (p == 0 || color != previous) {
+          previous = color;
+          color_id = reduced_ids[std::lower_bound(colors.begin(), colors.end(), color) - colors.begin()];
+        }
+        _color_ids.push_back(color_id);
+      }
+      if (indexed)
+        _indexed_pixels.insert(_indexed_pixels.end(), indexed_pixels.begin(), indexed_pixels.end());
+
+      uint8_t flags = 0;
+      if (colors.size() == 1 &&
+          std::adjacent_find(indexed_pixels.begin(), indexed_pixels.end(), std::not_equal_to<index_t>()) == indexed_pixels.end())
+        flags |= tile_solid;
+      if (reduced.size() == 1 && reduced[0] == transparent_color)
+        flags |= tile_transparent;
+      _flags.push_back(flags);
+    }
+  }
+  _id_count = crops.size();
+}
+
+void TileGrid::remap(unsigned index, const Subpalette& subpalette, index_t* data) const {
+  const auto colors = reduced_colors(index);
+  const auto ids = color_ids(index);
+
+  // each reduced color is looked up once, tiles with more colors than a subpalette holds look up the excess per pixel
+  constexpr size_t table_size = 256;
+  std::array<index_t, table_size> table;
+  for (size_t c = 0; c < std::min(colors.size(), table_size); ++c)
+    table[c] = subpalette.remap_reduced_index(colors[c]);
+  for (size_t p = 0; p < ids.size(); ++p)
+    data[p] = ids[p] < table_size ? table[ids[p]] : subpalette.remap_reduced_index(colors[ids[p]]);
+}
+
 void Image::save(const std::string& path) const {
-  unsigned error = lodepng::encode(path.c_str(), _data, _width, _height, LCT_RGBA, 8);
+  byte_vec_t buffer;
+  unsigned error = lodepng::encode(buffer, _data, _width, _height, LCT_RGBA, 8);
   if (error)
     throw std::runtime_error(lodepng_error_text(error));
+  write_file(path, buffer);
 }
 
 void Image::save_indexed(const std::string& path) {
@@ -248,14 +484,16 @@ void Image::save_indexed(const std::string& path) {
   unsigned error = lodepng::encode(buffer, _indexed_data, _width, _height, state);
   if (error)
     throw std::runtime_error(lodepng_error_text(error));
-  lodepng::save_file(buffer, path.c_str());
+  write_file(path, buffer);
 }
 
 void Image::save_scaled(const std::string& path, Mode mode) {
   auto scaled_data = to_bytes(normalize_colors(reduce_colors(rgba_data(), mode), mode));
-  unsigned error = lodepng::encode(path.c_str(), scaled_data, _width, _height, LCT_RGBA, 8);
+  byte_vec_t buffer;
+  unsigned error = lodepng::encode(buffer, scaled_data, _width, _height, LCT_RGBA, 8);
   if (error)
     throw std::runtime_error(lodepng_error_text(error));
+  write_file(path, buffer);
 }
 
 const std::string Image::description() const {
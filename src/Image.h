@@ -4,6 +4,9 @@
 
 #pragma once
 
+#include <memory>
+#include <span>
+
 #include <LodePNG/lodepng.h>
 
 #include "Common.h"
@@ -13,6 +16,7 @@
 
 namespace sfc {
 
+struct CropIndex;
 struct Subpalette;
 struct Palette;
 struct Tileset;
@@ -20,9 +24,12 @@ struct Tileset;
 struct Image final {
   Image(){};
   Image(const std::string& path);
+  Image(const byte_vec_t& png_data);
+  Image(const rgba_vec_t& rgba_data, unsigned width, unsigned height);
   Image(const sfc::Palette& palette);
   Image(const sfc::Tileset& tileset, unsigned width = 128);
-  Image(const Image& image, const sfc::Subpalette& subpalette);
+  // with indexed_only set, only indexed data and palette are produced (rgba data and color set are left empty)
+  Image(const Image& image, const sfc::Subpalette& subpalette, bool indexed_only = false);
 
   unsigned width() const { return _width; }
   unsigned height() const { return _height; }
@@ -33,8 +40,9 @@ struct Image final {
 
   rgba_vec_t rgba_data() const;
   rgba_vec_t palette() const { return _palette; };
-  index_vec_t indexed_data() const { return _indexed_data; }
-  rgba_set_t colors() const { return _colors; }
+  const index_vec_t& indexed_data() const { return _indexed_data; }
+  const rgba_set_t& colors() const { return _colors; }
+  unsigned color_count() const { return (unsigned)_colors.size(); }
 
   rgba_t rgba_color_at(unsigned index) const {
     return (_data[index * 4]) + (_data[(index * 4) + 1] << 8) + (_data[(index * 4) + 2] << 16) + (_data[(index * 4) + 3] << 24);
@@ -42,6 +50,8 @@ struct Image final {
 
   Image crop(unsigned x, unsigned y, unsigned width, unsigned height, Mode mode) const;
   std::vector<Image> crops(unsigned tile_width, unsigned tile_height, Mode mode) const;
+  // crops of row_count rows of tiles starting at tile row first_row
+  std::vector<Image> crops(unsigned tile_width, unsigned tile_height, Mode mode, unsigned first_row, unsigned row_count) const;
 
   void save(const std::string& path) const;
   void save_indexed(const std::string& path);
@@ -59,6 +69,7 @@ private:
   rgba_vec_t _palette;
   rgba_set_t _colors;
 
+  void decode(const byte_vec_t& png_data);
   void set_pixel(const rgba_t color, const unsigned index);
   void set_pixel(const rgba_t color, const unsigned x, const unsigned y);
   void blit(const rgba_vec_t& rgba_data, const unsigned x, const unsigned y, const unsigned width);
@@ -67,6 +78,118 @@ private:
   void blit_indexed(const index_vec_t& data, const unsigned x, const unsigned y, const unsigned width);
 
   void set_default_palette(const unsigned indices = 256);
+
+  friend struct TileGrid;
+  friend struct CropIndex;
+};
+
+// image sliced into tiles in a single pass, with per tile statistics shared by the palette, tileset and map stages
+// statistics are kept as a structure of arrays indexed by tile, in row order, and pixel data once per distinct tile
+struct TileGrid final {
+  // reduced color of a pixel, as an index into the reduced colors of its tile
+  typedef uint16_t color_id_t;
+
+  TileGrid(const Image& image, unsigned tile_width, unsigned tile_height, Mode mode);
+
+  // band of row_count rows starting at first_row, with crop ids shared by all grids sliced with crops
+  TileGrid(const Image& image, unsigned tile_width, unsigned tile_height, Mode mode, unsigned first_row, unsigned row_count,
+           CropIndex& crops);
+
+  // columns live in the grid's arena, which moves with the grid
+  TileGrid(TileGrid&&) = default;
+  TileGrid& operator=(TileGrid&&) = delete;
+
+  unsigned tile_width() const { return _tile_width; }
+  unsigned tile_height() const { return _tile_height; }
+  unsigned columns() const { return _columns; }
+  unsigned rows() const { return _rows; }
+  unsigned size() const { return (unsigned)_x.size(); }
+
+  // source image coordinates
+  unsigned x(unsigned index) const { return _x[index]; }
+  unsigned y(unsigned index) const { return _y[index]; }
+
+  // index of first tile with pixel data identical to tile at index (index itself for the first occurrence)
+  unsigned first_identical(unsigned index) const { return _first_identical[index]; }
+
+  // id of distinct pixel data, assigned in order of first occurrence and below id_count()
+  // ids are comparable between grids of equal generation (grids sliced with the same CropIndex)
+  unsigned id(unsigned index) const { return _ids[index]; }
+  unsigned id_count() const { return _id_count; }
+  uint64_t generation() const { return _generation; }
+
+  // hash of raw pixel data (see CropIndex::hash())
+  uint64_t hash(unsigned index) const { return _hashes[index]; }
+
+  // number of unique colors before reduction
+  unsigned color_count(unsigned index) const { return _color_counts[index]; }
+
+  // all pixels of a single color (and index, for indexed images) or all reducing to the transparent color
+  // either way the tile remaps to a single color index
+  bool is_uniform(unsigned index) const { return _flags[index] & (tile_solid | tile_transparent); }
+
+  // unique colors reduced to mode color depth in ascending order, shared between identical tiles
+  std::span<const rgba_t> reduced_colors(unsigned index) const {
+    const unsigned slot = _slots[index];
+    return {_reduced_colors.data() + _color_offsets[slot], _reduced_colors.data() + _color_offsets[slot + 1]};
+  }
+
+  // reduced color id of each pixel in row order, shared between identical tiles
+  std::span<const color_id_t> color_ids(unsigned index) const {
+    const size_t size = (size_t)_tile_width * _tile_height;
+    return {_color_ids.data() + _slots[index] * size, size};
+  }
+
+  rgba_t reduced_color_at(unsigned index, unsigned pixel) const { return reduced_colors(index)[color_ids(index)[pixel]]; }
+
+  // source image indices of each pixel in row order, empty if the source image isn't indexed
+  std::span<const index_t> indexed_data(unsigned index) const {
+    const size_t size = _indexed_pixels.empty() ? 0 : (size_t)_tile_width * _tile_height;
+    return {_indexed_pixels.data() + _slots[index] * size, size};
+  }
+
+  // source image palette, shared by tiles taking their colors from it (null if the source image isn't indexed)
+  std::shared_ptr<const rgba_vec_t> palette() const { return _palette; }
+
+  // write tile_width * tile_height indices of tile at index remapped to subpalette, as Image(crop, subpalette) does
+  void remap(unsigned index, const Subpalette& subpalette, index_t* data) const;
+
+private:
+  enum TileFlags : uint8_t {
+    tile_solid = 1,
+    tile_transparent = 2,
+  };
+
+  Mode _mode = Mode::snes;
+  unsigned _tile_width = 0;
+  unsigned _tile_height = 0;
+  unsigned _columns = 0;
+  unsigned _rows = 0;
+
+  // per grid arena holding the columns below, released in one shot with the grid (eg. once a pipeline band is consumed)
+  std::unique_ptr<Arena> _arena = std::make_unique<Arena>();
+
+  std::pmr::vector<unsigned> _x{_arena->resource()};
+  std::pmr::vector<unsigned> _y{_arena->resource()};
+  std::pmr::vector<unsigned> _first_identical{_arena->resource()};
+  std::pmr::vector<unsigned> _ids{_arena->resource()};
+  unsigned _id_count = 0;
+  uint64_t _generation = 0;
+  std::pmr::vector<uint64_t> _hashes{_arena->resource()};
+  std::pmr::vector<unsigned> _color_counts{_arena->resource()};
+  std::pmr::vector<uint8_t> _flags{_arena->resource()};
+
+  // index of the distinct tile data of each tile, numbered in order of first occurrence within the grid
+  std::pmr::vector<unsigned> _slots{_arena->resource()};
+
+  // by slot, reduced colors at [_color_offsets[slot], _color_offsets[slot + 1]), color ids and indexed pixels
+  std::pmr::vector<unsigned> _color_offsets{_arena->resource()};
+  pmr::rgba_vec_t _reduced_colors{_arena->resource()};
+  std::pmr::vector<color_id_t> _color_ids{_arena->resource()};
+  pmr::index_vec_t _indexed_pixels{_arena->resource()};
+  std::shared_ptr<const rgba_vec_t> _palette;
+
+  void slice(const Image& image, unsigned first_row, unsigned row_count, CropIndex& crops);
 };
 
 } /* namespace sfc */
@@ -0,0 +1,131 @@
+// streaming json writer
+//
+// david lindecrantz <optiroc@me.com>
+
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+
+namespace sfc {
+
+// writes json formatted as nlohmann::json::dump(2), buffering output to stream
+// object keys are written in call order, so callers pass them sorted to match dump()
+struct JsonWriter final {
+  JsonWriter(std::ostream& out) : _out(out) {}
+  ~JsonWriter() { flush(); }
+
+  JsonWriter(const JsonWriter&) = delete;
+  JsonWriter& operator=(const JsonWriter&) = delete;
+
+  void begin_object() { open('{'); }
+  void end_object() { close('}'); }
+  void begin_array() { open('['); }
+  void end_array() { close(']'); }
+
+  void key(const char* name) {
+    element();
+    append_string(name);
+    _buffer += ": ";
+    _after_key = true;
+  }
+
+  void value(unsigned v) {
+    element();
+    fmt::format_to(std::back_inserter(_buffer), "{}", v);
+  }
+
+  void value(int v) {
+    element();
+    fmt::format_to(std::back_inserter(_buffer), "{}", v);
+  }
+
+  void value(const std::string& v) {
+    element();
+    append_string(v);
+  }
+
+  void flush() {
+    _out.write(_buffer.data(), _buffer.size());
+    _buffer.clear();
+  }
+
+private:
+  static constexpr size_t flush_size = 1 << 16;
+
+  std::ostream& _out;
+  std::string _buffer;
+  std::vector<unsigned> _counts; // elements written in each open container
+  bool _after_key = false;
+
+  // separator and indentation preceding a value or key
+  void element() {
+    if (_after_key) {
+      _after_key = false;
+      return;
+    }
+    if (_counts.empty())
+      return;
+    _buffer += _counts.back()++ ? ",\n" : "\n";
+    _buffer.append(_counts.size() * 2, ' ');
+    if (_buffer.size() >= flush_size)
+      flush();
+  }
+
+  void open(char c) {
+    element();
+    _buffer += c;
+    _counts.push_back(0);
+  }
+
+  void close(char c) {
+    const unsigned count = _counts.back();
+    _counts.pop_back();
+    if (count) {
+      _buffer += '\n';
+      _buffer.append(_counts.size() * 2, ' ');
+    }
+    _buffer += c;
+  }
+
+  void append_string(const std::string& s) {
+    _buffer += '"';
+    for (unsigned char c : s) {
+      switch (c) {
+      case '"':
+        _buffer += "\\\"";
+        break;
+      case '\\':
+        _buffer += "\\\\";
+        break;
+      case '\b':
+        _buffer += "\\b";
+        break;
+      case '\f':
+        _buffer += "\\f";
+        break;
+      case '\n':
+        _buffer += "\\n";
+        break;
+      case '\r':
+        _buffer += "\\r";
+        break;
+      case '\t':
+        _buffer += "\\t";
+        break;
+      default:
+        if (c < 0x20) {
+          fmt::format_to(std::back_inserter(_buffer), "\\u{:04x}", c);
+        } else {
+          _buffer += (char)c;
+        }
+      }
+    }
+    _buffer += '"';
+  }
+};
+
+} /* namespace sfc */
@@ -1,4 +1,8 @@
 #include "Map.h"
+#include "JsonWriter.h"
+#include "Parallel.h"
+
+#include <sstream>
 
 namespace sfc {
 
@@ -6,90 +10,337 @@ void Map::add(const sfc::Image& image, const sfc::Tileset& tileset, const sfc::P
   if (((pos_y * _map_width) + pos_x) > _entries.size())
     throw std::runtime_error("Map entry out of bounds");
 
+  MatchStatus status;
+  _entries[(pos_y * _map_width) + pos_x] = pack_entry(match(image, tileset, palette, bpp, status));
+  if (status != MatchStatus::matched)
+    fmt::print(stderr, "{}", diagnostic(status, image.src_coord_x(), image.src_coord_y()));
+}
+
+// add images in row order starting at entry first_index, matching them in parallel
+void Map::add(const std::vector<Image>& images, const Tileset& tileset, const Palette& palette, unsigned bpp, unsigned jobs,
+              unsigned first_index) {
+  std::vector<Mapentry> entries(images.size());
+  std::vector<MatchStatus> statuses(images.size());
+  std::vector<std::exception_ptr> errors(images.size());
+
+  parallel_for(images.size(), jobs, [&](size_t i) {
+    try {
+      if (first_index + i > _entries.size())
+        throw std::runtime_error("Map entry out of bounds");
+      entries[i] = match(images[i], tileset, palette, bpp, statuses[i]);
+    } catch (...) {
+      errors[i] = std::current_exception();
+    }
+  });
+
+  // report and store in order, as when adding one by one
+  for (size_t i = 0; i < images.size(); ++i) {
+    if (errors[i])
+      std::rethrow_exception(errors[i]);
+    if (statuses[i] != MatchStatus::matched)
+      fmt::print(stderr, "{}", diagnostic(statuses[i], images[i].src_coord_x(), images[i].src_coord_y()));
+    if (first_index + i < _entries.size())
+      _entries[first_index + i] = pack_entry(entries[i]);
+  }
+}
+
+// add crops of grid as adding them one by one does, matching each distinct crop once
+// crops repeating a crop matched by an earlier call reuse its entry while grids share ids and tileset and palette are unchanged
+void Map::add(const TileGrid& grid, const Tileset& tileset, const Palette& palette, unsigned bpp, unsigned jobs,
+              unsigned first_index) {
+  if (grid.generation() != _match_crops || tileset.generation() != _match_tileset || palette.generation() != _match_palette ||
+      bpp != _match_bpp) {
+    _crop_matches.clear();
+    _match_crops = grid.generation();
+    _match_tileset = tileset.generation();
+    _match_palette = palette.generation();
+    _match_bpp = bpp;
+  }
+  if (_crop_matches.size() < grid.id_count())
+    _crop_matches.resize(grid.id_count(), {Mapentry(), MatchStatus::pending});
+
+  Arena arena;
+  std::pmr::vector<std::exception_ptr> errors(grid.size(), arena.resource());
+
+  parallel_for(grid.size(), jobs, [&](size_t i) {
+    if (grid.first_identical((unsigned)i) != i)
+      return;
+    auto& m = _crop_matches[grid.id((unsigned)i)];
+    if (m.second != MatchStatus::pending)
+      return;
+    try {
+      MatchStatus status;
+      const Mapentry entry = match(grid, (unsigned)i, tileset, palette, bpp, status);
+      m = {entry, status};
+    } catch (...) {
+      errors[i] = std::current_exception();
+    }
+  });
+
+  // report and store in order, as when adding one by one
+  for (unsigned i = 0; i < grid.size(); ++i) {
+    if (first_index + i > _entries.size())
+      throw std::runtime_error("Map entry out of bounds");
+    if (errors[i])
+      std::rethrow_exception(errors[i]);
+
+    const auto& m = _crop_matches[grid.id(i)];
+    if (m.second != MatchStatus::matched)
+      fmt::print(stderr, "{}", diagnostic(m.second, grid.x(i), grid.y(i)));
+    if (first_index + i < _entries.size())
+      _entries[first_index + i] = pack_entry(m.first);
+  }
+}
+
+std::string Map::diagnostic(MatchStatus status, unsigned x, unsigned y) {
+  switch (status) {
+  case MatchStatus::no_match:
+    return fmt::format("  No matching tile for position {},{}\n", x, y);
+  case MatchStatus::index_exceeded:
+    return fmt::format("  Mapped tile exceeds allowed map index at position {},{}\n", x, y);
+  default:
+    return {};
+  }
+}
+
+// map entry for the first of subpalettes find(subpalette, flipped) returns a tileset index for
+// or an empty entry and failing status if there is no usable match
+template <typename F>
+Mapentry Map::match(const std::vector<const Subpalette*>& subpalettes, const Palette& palette, MatchStatus& status,
+                    F&& find) const {
   int tileset_index = -1;
   int palette_index = -1;
-  Tile matched_tile;
-  {
-    // search all viable palette mappings of image in tileset
-    const auto spv = palette.subpalettes_matching(image);
-    for (const auto& p : spv) {
-      const Image remapped_image = Image(image, *p);
-      Tile remapped_tile(remapped_image, _mode, bpp, true);
-      tileset_index = tileset.index_of(remapped_tile);
-      if (tileset_index != -1) {
-        palette_index = palette.index_of(*p);
-        matched_tile = remapped_tile;
-        break;
-      }
+  TileFlipped flipped;
+
+  // first match in palette order wins
+  for (const Subpalette* sp : subpalettes) {
+    tileset_index = find(*sp, flipped);
+    if (tileset_index != -1) {
+      palette_index = palette.index_of(*sp);
+      break;
     }
   }
 
   if (tileset_index == -1) {
-    fmt::print(stderr, "  No matching tile for position {},{}\n", image.src_coord_x(), image.src_coord_y());
-    _entries[(pos_y * _map_width) + pos_x] = Mapentry(0, 0, false, false);
+    status = MatchStatus::no_match;
+    return Mapentry(0, 0, false, false);
 
   } else if (tileset_index >= (int)max_tile_count_for_mode(_mode)) {
-    fmt::print(stderr, "  Mapped tile exceeds allowed map index at position {},{}\n", image.src_coord_x(), image.src_coord_y());
-    _entries[(pos_y * _map_width) + pos_x] = Mapentry(0, 0, false, false);
+    status = MatchStatus::index_exceeded;
+    return Mapentry(0, 0, false, false);
 
   } else {
-    const TileFlipped flipped = tileset.tiles()[tileset_index].is_flipped(matched_tile);
-    _entries[(pos_y * _map_width) + pos_x] =
-      Mapentry(tileset_index, palette_index, flipped.h, flipped.v);
+    status = MatchStatus::matched;
+    return Mapentry(tileset_index, palette_index, flipped.h, flipped.v);
   }
 }
 
+// map entry for image, searching all viable palette mappings of image in tileset
+Mapentry Map::match(const Image& image, const Tileset& tileset, const Palette& palette, unsigned bpp,
+                    MatchStatus& status) const {
+  return match(palette.subpalettes_matching(image), palette, status, [&](const Subpalette& sp, TileFlipped& flipped) {
+    const Tile remapped_tile(Image(image, sp, true), _mode, bpp, true, sp.shared_normalized_colors());
+    return tileset.index_of(remapped_tile, &flipped);
+  });
+}
+
+// same as matching a crop of tile at index of grid, remapping the grid's color ids
+// uniform tiles (see Tileset::is_uniform()) are looked up by color index without remapping
+Mapentry Map::match(const TileGrid& grid, unsigned index, const Tileset& tileset, const Palette& palette, unsigned bpp,
+                    MatchStatus& status) const {
+  const auto subpalettes = palette.subpalettes_matching(grid, index);
+
+  if (tileset.is_uniform(grid, index) && tileset.has_uniform_lookup()) {
+    // uniform tiles are unflipped and found by color index alone
+    const rgba_t color = grid.reduced_color_at(index, 0);
+    return match(subpalettes, palette, status, [&](const Subpalette& sp, TileFlipped&) {
+      return tileset.index_of_uniform(sp.remap_reduced_index(color) & bitmask_at_bpp(bpp));
+    });
+  }
+
+  // remap into scratch on the stack for tiles up to 16x16
+  const size_t size = (size_t)grid.tile_width() * grid.tile_height();
+  tile_16x16_t scratch;
+  index_vec_t sized(size > scratch.size() ? size : 0);
+  index_t* data = sized.empty() ? scratch.data() : sized.data();
+  const index_t mask = bitmask_at_bpp(bpp);
+  const bool same_size = grid.tile_width() == tileset.tile_width() && grid.tile_height() == tileset.tile_height();
+  return match(subpalettes, palette, status, [&](const Subpalette& sp, TileFlipped& flipped) {
+    if (!same_size)
+      return -1;
+    grid.remap(index, sp, data);
+    for (size_t p = 0; p < size; ++p)
+      data[p] &= mask;
+    return tileset.index_of(data, &flipped);
+  });
+}
+
+uint32_t Map::pack_entry(const Mapentry& entry) {
+  if (entry.tile_index > max_tile_index)
+    throw std::runtime_error(fmt::format("Map entry tile index {} exceeds limit of {}", entry.tile_index, max_tile_index));
+  if (entry.palette_index > max_palette_index)
+    throw std::runtime_error(
+      fmt::format("Map entry palette index {} exceeds limit of {}", entry.palette_index, max_palette_index));
+  return entry.tile_index | (entry.palette_index << 20) | ((uint32_t)entry.flip_h << 30) | ((uint32_t)entry.flip_v << 31);
+}
+
+Mapentry Map::unpack_entry(uint32_t packed) {
+  return Mapentry(packed & 0xfffff, (packed >> 20) & 0x3ff, (packed >> 30) & 1, (packed >> 31) & 1);
+}
+
 Mapentry Map::entry_at(unsigned x, unsigned y) const {
   if (x > _map_width)
     x = _map_width;
   if (y > _map_height)
     y = _map_height;
-  if (((y * _map_width) + x) > _entries.size()) {
+  if (((y * _map_width) + x) >= _entries.size()) {
     return Mapentry();
   } else {
-    Mapentry entry = _entries[(y * _map_width) + x];
-    if (_tile_width == 8 && _tile_height == 8)
-      return entry;
-
-    // snes non-8x8 tilemap
-    unsigned tile_col = entry.tile_index % 8;
-    unsigned tile_row = entry.tile_index / 8;
-    entry.tile_index = tile_col * (_tile_width == 8 ? 1 : 2) + tile_row * (_tile_height == 8 ? 16 : 32);
+    return translated_entry(_entries[(y * _map_width) + x]);
+  }
+}
+
+// unpack entry, translating tile index for snes non-8x8 tilemaps
+Mapentry Map::translated_entry(uint32_t packed) const {
+  Mapentry entry = unpack_entry(packed);
+  if (_tile_width == 8 && _tile_height == 8)
     return entry;
+
+  unsigned tile_col = entry.tile_index % 8;
+  unsigned tile_row = entry.tile_index / 8;
+  entry.tile_index = tile_col * (_tile_width == 8 ? 1 : 2) + tile_row * (_tile_height == 8 ? 16 : 32);
+  return entry;
+}
+
+namespace {
+
+// transpose rows x columns matrix into columns x rows matrix, in blocks fitting in cache
+void transpose(const uint32_t* src, uint32_t* dst, unsigned rows, unsigned columns) {
+  const unsigned block = 16;
+  for (unsigned r0 = 0; r0 < rows; r0 += block) {
+    const unsigned r1 = std::min(r0 + block, rows);
+    for (unsigned c0 = 0; c0 < columns; c0 += block) {
+      const unsigned c1 = std::min(c0 + block, columns);
+      for (unsigned c = c0; c < c1; ++c) {
+        for (unsigned r = r0; r < r1; ++r)
+          dst[(size_t)c * rows + r] = src[(size_t)r * columns + c];
+      }
+    }
+  }
+}
+
+} // namespace
+
+// call fn(entries, count, translate) for each output screen, with packed entries in output order
+// an unsplit map is passed as stored, split screens are read as by entry_at() and have translate set
+template <typename F>
+void Map::for_each_screen(bool column_order, unsigned split_w, unsigned split_h, F&& fn) const {
+  if (split_w > _map_width || split_w == 0)
+    split_w = _map_width;
+  if (split_h > _map_height || split_h == 0)
+    split_h = _map_height;
+
+  std::vector<uint32_t> transposed;
+
+  if (split_w == _map_width && split_h == _map_height) {
+    if (!column_order) {
+      fn(_entries.data(), _entries.size(), false);
+    } else {
+      transposed.resize(_entries.size());
+      transpose(_entries.data(), transposed.data(), split_h, split_w);
+      fn(transposed.data(), transposed.size(), false);
+    }
+    return;
+  }
+
+  // screen buffers are reused for every screen
+  const size_t screen_size = (size_t)split_w * split_h;
+  std::vector<uint32_t> screen(screen_size);
+  if (column_order)
+    transposed.resize(screen_size);
+
+  unsigned columns = (div_ceil(_map_width, split_w) == 0) ? 1 : div_ceil(_map_width, split_w);
+  unsigned rows = (div_ceil(_map_height, split_h) == 0) ? 1 : div_ceil(_map_height, split_h);
+  for (unsigned col = 0; col < columns; ++col) {
+    for (unsigned row = 0; row < rows; ++row) {
+      const unsigned origin_x = col * split_w;
+      const unsigned origin_y = row * split_h;
+
+      for (unsigned y = 0; y < split_h; ++y) {
+        uint32_t* dst = &screen[(size_t)y * split_w];
+        const unsigned map_y = std::min(origin_y + y, _map_height);
+        if (origin_x + split_w <= _map_width && map_y < _map_height) {
+          std::memcpy(dst, &_entries[(size_t)map_y * _map_width + origin_x], split_w * sizeof(uint32_t));
+          continue;
+        }
+        // screen extends past map edge, clamped as in entry_at()
+        for (unsigned x = 0; x < split_w; ++x) {
+          const size_t index = (size_t)map_y * _map_width + std::min(origin_x + x, _map_width);
+          dst[x] = index < _entries.size() ? _entries[index] : 0;
+        }
+      }
+
+      if (column_order) {
+        transpose(screen.data(), transposed.data(), split_h, split_w);
+        fn(transposed.data(), screen_size, true);
+      } else {
+        fn(screen.data(), screen_size, true);
+      }
+    }
   }
 }
 
 void Map::add_base_offset(int offset) {
+  // check range up front so a failed offset leaves the map untouched
+  unsigned max_index = 0;
+  for (auto e : _entries)
+    max_index = std::max(max_index, unpack_entry(e).tile_index);
+  if ((int64_t)max_index + offset > max_tile_index)
+    throw std::runtime_error(fmt::format("Tile base offset {} puts tile index {} beyond limit of {}", offset,
+                                         (int64_t)max_index + offset, max_tile_index));
+
   for (auto& e : _entries) {
-    e.tile_index = (unsigned)std::max(0, (int)e.tile_index + offset);
+    Mapentry entry = unpack_entry(e);
+    entry.tile_index = (unsigned)std::max(0, (int)entry.tile_index + offset);
+    e = pack_entry(entry);
   }
 }
 
 void Map::add_palette_base_offset(int offset) {
+  unsigned max_index = 0;
+  for (auto e : _entries)
+    max_index = std::max(max_index, unpack_entry(e).palette_index);
+  if ((int64_t)max_index + offset > max_palette_index)
+    throw std::runtime_error(fmt::format("Palette base offset {} puts palette index {} beyond limit of {}", offset,
+                                         (int64_t)max_index + offset, max_palette_index));
+
   for (auto& e : _entries) {
-    e.palette_index = (unsigned)std::max(0, (int)e.palette_index + offset);
+    Mapentry entry = unpack_entry(e);
+    entry.palette_index = (unsigned)std::max(0, (int)entry.palette_index + offset);
+    e = pack_entry(entry);
   }
 }
 
 byte_vec_t Map::native_data(bool column_order, unsigned split_w, unsigned split_h) const {
   byte_vec_t data;
-  for (const auto& vm : collect_entries(column_order, split_w, split_h)) {
-    for (const auto& m : vm) {
-      auto nd = sfc::pack_native_mapentry(m, _mode);
-      data.insert(data.end(), nd.begin(), nd.end());
-    }
-  }
+  for_each_screen(column_order, split_w, split_h, [&](const uint32_t* entries, size_t count, bool translate) {
+    data.reserve(data.size() + count * 2);
+    for (size_t i = 0; i < count; ++i)
+      sfc::pack_native_mapentry(translate ? translated_entry(entries[i]) : unpack_entry(entries[i]), _mode, data);
+  });
   return data;
 }
 
 byte_vec_t Map::palette_map(bool column_order, unsigned split_w, unsigned split_h) const {
   byte_vec_t data;
-  for (const auto& vm : collect_entries(column_order, split_w, split_h)) {
-    for (const auto& m : vm) {
-      data.push_back(m.palette_index & 0xFF);
-      data.push_back(m.palette_index >> 8);
+  for_each_screen(column_order, split_w, split_h, [&](const uint32_t* entries, size_t count, bool) {
+    data.reserve(data.size() + count * 2);
+    for (size_t i = 0; i < count; ++i) {
+      const unsigned palette_index = unpack_entry(entries[i]).palette_index;
+      data.push_back(palette_index & 0xFF);
+      data.push_back(palette_index >> 8);
     }
-  }
+  });
   return data;
 }
 
@@ -127,76 +378,68 @@ void Map::save_pal_map(const std::string& path, bool column_order, unsigned spli
 }
 
 const std::string Map::to_json(bool column_order, unsigned split_w, unsigned split_h) const {
-  nlohmann::json j;
-  const auto vmm = collect_entries(column_order, split_w, split_h);
+  std::ostringstream out;
+  write_json(out, column_order, split_w, split_h);
+  return out.str();
+}
+
+void Map::save_json(const std::string& path, bool column_order, unsigned split_w, unsigned split_h) const {
+  OutputFile file(path, false);
+  write_json(file.stream(), column_order, split_w, split_h);
+  file.commit();
+}
 
-  for (const auto& vm : vmm) {
-    nlohmann::json ja = nlohmann::json::array();
+// stream json map data, formatted as a json document dumped with indent 2
+void Map::write_json(std::ostream& out, bool column_order, unsigned split_w, unsigned split_h) const {
+  const bool flips = tile_flipping_allowed_for_mode(_mode);
+  const bool palettes = default_palette_count_for_mode(_mode) > 1;
+  const bool multiple = screen_count(split_w, split_h) > 1;
 
-    if (tile_flipping_allowed_for_mode(_mode) && default_palette_count_for_mode(_mode) > 1) {
-      for (const auto& m : vm) {
-        ja.push_back(
-          {{"tile", m.tile_index}, {"palette", m.palette_index}, {"flip_h", (int)m.flip_h}, {"flip_v", (int)m.flip_v}});
-      }
-    } else if (tile_flipping_allowed_for_mode(_mode)) {
-      for (const auto& m : vm) {
-        ja.push_back({{"tile", m.tile_index}, {"flip_h", (int)m.flip_h}, {"flip_v", (int)m.flip_v}});
-      }
-    } else if (default_palette_count_for_mode(_mode) > 1) {
-      for (const auto& m : vm) {
-        ja.push_back({{"tile", m.tile_index}, {"palette", m.palette_index}});
+  JsonWriter json(out);
+  json.begin_object();
+  json.key(multiple ? "maps" : "map");
+  if (multiple)
+    json.begin_array();
+
+  for_each_screen(column_order, split_w, split_h, [&](const uint32_t* entries, size_t count, bool translate) {
+    json.begin_array();
+    for (size_t i = 0; i < count; ++i) {
+      const Mapentry m = translate ? translated_entry(entries[i]) : unpack_entry(entries[i]);
+      json.begin_object();
+      if (flips) {
+        json.key("flip_h");
+        json.value((int)m.flip_h);
+        json.key("flip_v");
+        json.value((int)m.flip_v);
       }
-    } else {
-      for (const auto& m : vm) {
-        ja.push_back({{"tile", m.tile_index}});
+      if (palettes) {
+        json.key("palette");
+        json.value(m.palette_index);
       }
+      json.key("tile");
+      json.value(m.tile_index);
+      json.end_object();
     }
+    json.end_array();
+  });
 
-    if (vmm.size() > 1) {
-      j["maps"].emplace_back(ja);
-    } else {
-      j["map"] = ja;
-    }
-  }
-  return j.dump(2);
+  if (multiple)
+    json.end_array();
+  json.end_object();
 }
 
-std::vector<std::vector<Mapentry>> Map::collect_entries(bool column_order, unsigned split_w, unsigned split_h) const {
-  std::vector<std::vector<Mapentry>> vvm;
-
+// number of output screens for split size
+unsigned Map::screen_count(unsigned split_w, unsigned split_h) const {
   if (split_w > _map_width || split_w == 0)
     split_w = _map_width;
   if (split_h > _map_height || split_h == 0)
     split_h = _map_height;
+  if (split_w == _map_width && split_h == _map_height)
+    return 1;
 
-  if (split_w == _map_width && split_h == _map_height) {
-    vvm.push_back(_entries);
-  } else {
-    unsigned columns = (div_ceil(_map_width, split_w) == 0) ? 1 : div_ceil(_map_width, split_w);
-    unsigned rows = (div_ceil(_map_height, split_h) == 0) ? 1 : div_ceil(_map_height, split_h);
-    for (unsigned col = 0; col < columns; ++col) {
-      for (unsigned row = 0; row < rows; ++row) {
-        std::vector<Mapentry> vm;
-        for (unsigned pos = 0; pos < split_w * split_h; ++pos) {
-          vm.push_back(entry_at((col * split_w) + (pos % split_w), (row * split_h) + (pos / split_w)));
-        }
-        vvm.push_back(vm);
-      }
-    }
-  }
-
-  if (column_order) {
-    std::vector<std::vector<Mapentry>> vvmo;
-    for (unsigned vmi = 0; vmi < vvm.size(); ++vmi) {
-      vvmo.push_back(std::vector<Mapentry>());
-      for (unsigned pos = 0; pos < vvm[vmi].size(); ++pos) {
-        vvmo.back().push_back(vvm[vmi][((pos * split_w) + (pos / split_h)) % (split_w * split_h)]);
-      }
-    }
-    return vvmo;
-  }
-
-  return vvm;
+  unsigned columns = (div_ceil(_map_width, split_w) == 0) ? 1 : div_ceil(_map_width, split_w);
+  unsigned rows = (div_ceil(_map_height, split_h) == 0) ? 1 : div_ceil(_map_height, split_h);
+  return columns * rows;
 }
 
 } /* namespace sfc */
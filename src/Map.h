@@ -14,6 +14,7 @@ namespace sfc {
 
 struct Image;
 struct Palette;
+struct TileGrid;
 struct Tileset;
 
 struct Mapentry final {
@@ -28,6 +29,10 @@ struct Mapentry final {
 
 
 struct Map final {
+  // largest indices a map entry can hold, see _entries
+  static constexpr unsigned max_tile_index = 0xfffff;
+  static constexpr unsigned max_palette_index = 0x3ff;
+
   Map(Mode mode = Mode::snes, unsigned map_width = 32, unsigned map_height = 32, unsigned tile_width = 8, unsigned tile_height = 8)
   : _mode(mode), _map_width(map_width), _map_height(map_height), _tile_width(tile_width), _tile_height(tile_height) {
     _entries.resize(map_width * map_height);
@@ -37,8 +42,13 @@ struct Map final {
   unsigned height() const { return _map_height; }
 
   void add(const Image& image, const Tileset& tileset, const Palette& palette, unsigned bpp, unsigned pos_x, unsigned pos_y);
+  void add(const std::vector<Image>& images, const Tileset& tileset, const Palette& palette, unsigned bpp, unsigned jobs = 1,
+           unsigned first_index = 0);
+  void add(const TileGrid& grid, const Tileset& tileset, const Palette& palette, unsigned bpp, unsigned jobs = 1,
+           unsigned first_index = 0);
   Mapentry entry_at(unsigned x, unsigned y) const;
 
+  // offset indices of all entries, clamping at zero (throws if an index would exceed its limit)
   void add_base_offset(int offset);
   void add_palette_base_offset(int offset);
 
@@ -49,7 +59,9 @@ struct Map final {
 
   void save(const std::string& path, bool column_order = false, unsigned split_w = 0, unsigned split_h = 0) const;
   void save_pal_map(const std::string& path, bool column_order = false, unsigned split_w = 0, unsigned split_h = 0) const;
+  void save_json(const std::string& path, bool column_order = false, unsigned split_w = 0, unsigned split_h = 0) const;
   const std::string to_json(bool column_order = false, unsigned split_w = 0, unsigned split_h = 0) const;
+  void write_json(std::ostream& out, bool column_order = false, unsigned split_w = 0, unsigned split_h = 0) const;
 
 private:
   Mode _mode = Mode::snes;
@@ -58,14 +70,44 @@ private:
   unsigned _tile_width = 8;
   unsigned _tile_height = 8;
 
-  std::vector<Mapentry> _entries;
+  // entries packed as tile index (bits 0-19), palette index (bits 20-29), flip_h (bit 30) and flip_v (bit 31)
+  std::vector<uint32_t> _entries;
+  static_assert(max_tile_index == (1u << 20) - 1 && max_palette_index == (1u << 10) - 1,
+                "index limits must match the packed entry layout");
+
+  static uint32_t pack_entry(const Mapentry& entry);
+  static Mapentry unpack_entry(uint32_t packed);
+  Mapentry translated_entry(uint32_t packed) const;
 
-  std::vector<std::vector<Mapentry>> collect_entries(bool column_order = false, unsigned split_w = 0, unsigned split_h = 0) const;
+  enum class MatchStatus : uint8_t {
+    pending,
+    matched,
+    no_match,
+    index_exceeded,
+  };
+
+  // entries matched by add(grid) by grid crop id, valid for grids of generation _match_crops matched against tileset and
+  // palette generations _match_tileset and _match_palette at _match_bpp
+  std::vector<std::pair<Mapentry, MatchStatus>> _crop_matches;
+  uint64_t _match_crops = 0;
+  uint64_t _match_tileset = 0;
+  uint64_t _match_palette = 0;
+  unsigned _match_bpp = 0;
+
+  Mapentry match(const Image& image, const Tileset& tileset, const Palette& palette, unsigned bpp, MatchStatus& status) const;
+  Mapentry match(const TileGrid& grid, unsigned index, const Tileset& tileset, const Palette& palette, unsigned bpp,
+                 MatchStatus& status) const;
+  template <typename F>
+  Mapentry match(const std::vector<const Subpalette*>& subpalettes, const Palette& palette, MatchStatus& status, F&& find) const;
+  static std::string diagnostic(MatchStatus status, unsigned x, unsigned y);
+  unsigned screen_count(unsigned split_w, unsigned split_h) const;
+  template <typename F>
+  void for_each_screen(bool column_order, unsigned split_w, unsigned split_h, F&& fn) const;
 };
 
 
-inline byte_vec_t pack_native_mapentry(const Mapentry& entry, Mode mode) {
-  byte_vec_t v;
+// append native map entry to v
+inline void pack_native_mapentry(const Mapentry& entry, Mode mode, byte_vec_t& v) {
   switch (mode) {
   case Mode::snes:
     v.push_back(entry.tile_index & 0xff);
@@ -132,6 +174,11 @@ inline byte_vec_t pack_native_mapentry(const Mapentry& entry, Mode mode) {
   case Mode::none:
     break;
   }
+}
+
+inline byte_vec_t pack_native_mapentry(const Mapentry& entry, Mode mode) {
+  byte_vec_t v;
+  pack_native_mapentry(entry, mode, v);
   return v;
 }
 
@@ -4,6 +4,9 @@
 
 #pragma once
 
+#include <array>
+#include <cstring>
+
 #include "Color.h"
 #include "Common.h"
 
@@ -724,59 +727,94 @@ inline rgba_vec_t unpack_native_colors(const byte_vec_t& colors, Mode mode) {
 // to/from native tile data
 //
 
-inline byte_vec_t pack_native_tile(const index_vec_t& data, Mode mode, unsigned bpp, unsigned width, unsigned height) {
+// 8x8 tile in bitsliced form, one word per bit plane
+// byte y of each word holds pixel row y with the leftmost pixel in bit 7, as in native planar data
+typedef std::array<uint64_t, 8> tile_planes_t;
+
+// slice 8x8 tile data into its lowest bit planes
+inline tile_planes_t slice_tile(const index_t* data, unsigned planes = 8) {
+  tile_planes_t tp = {};
+  for (unsigned y = 0; y < 8; ++y) {
+    // pixel x in byte x regardless of host byte order
+    uint64_t row = 0;
+    for (unsigned x = 0; x < 8; ++x)
+      row |= (uint64_t)data[y * 8 + x] << (x * 8);
+    for (unsigned p = 0; p < planes && p < tp.size(); ++p) {
+      // gather bit p of each pixel byte, pixel 0 ending up in bit 7
+      const uint64_t bits = ((row >> p) & 0x0101010101010101) * 0x8040201008040201;
+      tp[p] |= (bits >> 56) << (y * 8);
+    }
+  }
+  return tp;
+}
 
-  // wsc/sms/gg planar style bit planes
-  auto make_4bit_planes = [](const index_vec_t& in_data, unsigned plane_index) {
-    byte_vec_t p(32);
-    if (in_data.empty())
-      return p;
+// mirror bit plane horizontally (reverse bits in each row byte)
+constexpr uint64_t flip_plane_h(uint64_t plane) {
+  plane = ((plane >> 1) & 0x5555555555555555) | ((plane & 0x5555555555555555) << 1);
+  plane = ((plane >> 2) & 0x3333333333333333) | ((plane & 0x3333333333333333) << 2);
+  return ((plane >> 4) & 0x0f0f0f0f0f0f0f0f) | ((plane & 0x0f0f0f0f0f0f0f0f) << 4);
+}
 
-    index_t mask0 = 1;
-    for (unsigned i = 0; i < plane_index; ++i)
-      mask0 <<= 1;
-    index_t mask1 = mask0 << 1;
-    index_t mask2 = mask1 << 1;
-    index_t mask3 = mask2 << 1;
+// mirror bit plane vertically (reverse row bytes)
+constexpr uint64_t flip_plane_v(uint64_t plane) {
+  plane = ((plane >> 8) & 0x00ff00ff00ff00ff) | ((plane & 0x00ff00ff00ff00ff) << 8);
+  plane = ((plane >> 16) & 0x0000ffff0000ffff) | ((plane & 0x0000ffff0000ffff) << 16);
+  return (plane >> 32) | (plane << 32);
+}
+
+// true if mode's native tile data is 8x8 bit planes, as packed from tile_planes_t
+constexpr bool planar_tiles_for_mode(Mode mode) {
+  switch (mode) {
+  case Mode::snes:
+  case Mode::gb:
+  case Mode::gbc:
+  case Mode::pce:
+  case Mode::ws:
+  case Mode::wsc:
+  case Mode::gg:
+  case Mode::sms:
+    return true;
+  default:
+    return false;
+  }
+}
 
-    unsigned shift0 = plane_index;
-    unsigned shift1 = plane_index + 1;
-    unsigned shift2 = plane_index + 2;
-    unsigned shift3 = plane_index + 3;
+// pack bitsliced tile to native format
+inline byte_vec_t pack_native_tile(const tile_planes_t& planes, Mode mode, unsigned bpp) {
+  auto row = [&](unsigned plane, unsigned y) { return (uint8_t)(planes[plane] >> (y * 8)); };
 
-    for (unsigned y = 0; y < 8; ++y) {
-      for (unsigned x = 0; x < 8; ++x) {
-        p[y * 4 + 0] |= ((in_data[y * 8 + x] & mask0) >> shift0) << (7 - x);
-        p[y * 4 + 1] |= ((in_data[y * 8 + x] & mask1) >> shift1) << (7 - x);
-        p[y * 4 + 2] |= ((in_data[y * 8 + x] & mask2) >> shift2) << (7 - x);
-        p[y * 4 + 3] |= ((in_data[y * 8 + x] & mask3) >> shift3) << (7 - x);
+  byte_vec_t nd;
+  if (mode == Mode::snes || mode == Mode::gb || mode == Mode::gbc || mode == Mode::pce) {
+    // plane pairs with interleaved rows, 1bpp as a single plane
+    nd.reserve(bpp * 8);
+    for (unsigned p = 0; p + 1 < bpp; p += 2) {
+      for (unsigned y = 0; y < 8; ++y) {
+        nd.push_back(row(p, y));
+        nd.push_back(row(p + 1, y));
       }
     }
-    return p;
-  };
-
-  // snes/gameboy style bit planes
-  auto make_2bit_planes = [](const index_vec_t& in_data, unsigned plane_index) {
-    byte_vec_t p(16);
-    if (in_data.empty())
-      return p;
-
-    index_t mask0 = 1;
-    for (unsigned i = 0; i < plane_index; ++i)
-      mask0 <<= 1;
-    index_t mask1 = mask0 << 1;
-
-    unsigned shift0 = plane_index;
-    unsigned shift1 = plane_index + 1;
+    if (bpp == 1) {
+      for (unsigned y = 0; y < 8; ++y)
+        nd.push_back(row(0, y));
+    }
 
+  } else if (mode == Mode::ws || mode == Mode::wsc || mode == Mode::gg || mode == Mode::sms) {
+    // all planes interleaved per row
+    if (bpp != 4 && bpp != 2)
+      throw std::runtime_error(fmt::format("programmer error (unsupported bpp for mode \"{}\")", sfc::mode(mode)));
+    nd.reserve(bpp * 8);
     for (unsigned y = 0; y < 8; ++y) {
-      for (unsigned x = 0; x < 8; ++x) {
-        p[y * 2 + 0] |= ((in_data[y * 8 + x] & mask0) >> shift0) << (7 - x);
-        p[y * 2 + 1] |= ((in_data[y * 8 + x] & mask1) >> shift1) << (7 - x);
-      }
+      for (unsigned p = 0; p < bpp; ++p)
+        nd.push_back(row(p, y));
     }
-    return p;
-  };
+
+  } else {
+    throw std::runtime_error(fmt::format("programmer error (no planar tile format for mode \"{}\")", sfc::mode(mode)));
+  }
+  return nd;
+}
+
+inline byte_vec_t pack_native_tile(const index_vec_t& data, Mode mode, unsigned bpp, unsigned width, unsigned height) {
 
   // regular bit planes
   auto make_1bit_planes = [](const index_vec_t& in_data, unsigned plane, bool reverse) {
@@ -846,30 +884,14 @@ inline byte_vec_t pack_native_tile(const index_vec_t& data, Mode mode, unsigned
       throw std::runtime_error(
         fmt::format("programmer error (tile size not 8x8 in pack_native_tile() for mode \"{}\")", sfc::mode(mode)));
 
-    unsigned planes = bpp >> 1;
-    for (unsigned i = 0; i < planes; ++i) {
-      auto plane = make_2bit_planes(data, i * 2);
-      nd.insert(nd.end(), plane.begin(), plane.end());
-    }
-    // 1bpp had 0 iterations
-    if(bpp == 1) {
-      auto plane = make_1bit_planes(data, 0, true);
-      nd.insert(nd.end(), plane.begin(), plane.end());
-    }
+    nd = pack_native_tile(data.empty() ? tile_planes_t{} : slice_tile(data.data(), bpp), mode, bpp);
 
   } else if (mode == Mode::ws || mode == Mode::wsc || mode == Mode::gg || mode == Mode::sms) {
     if (width != 8 || height != 8)
       throw std::runtime_error(
         fmt::format("programmer error (tile size not 8x8 in pack_native_tile() for mode \"{}\")", sfc::mode(mode)));
 
-    if (bpp == 4) {
-      nd = make_4bit_planes(data, 0);
-    } else if (bpp == 2) {
-      nd = make_2bit_planes(data, 0);
-    } else {
-      throw std::runtime_error(
-        fmt::format("programmer error (unsupported bpp for mode \"{}\")", sfc::mode(mode)));
-    }
+    nd = pack_native_tile(data.empty() ? tile_planes_t{} : slice_tile(data.data(), bpp), mode, bpp);
 
   } else if (mode == Mode::ngp || mode == Mode::ngpc) {
     if (width != 8 || height != 8)
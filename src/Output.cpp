@@ -0,0 +1,53 @@
+#include "Output.h"
+
+#include <chrono>
+#include <filesystem>
+
+#include "Common.h"
+#include "Parallel.h"
+#include "Trace.h"
+
+namespace sfc {
+
+void OutputQueue::add(const char* trace_name, const std::string& description, const std::string& path,
+                      std::function<void(const std::string&)> write_fn) {
+  _outputs.push_back({trace_name, description, path, std::move(write_fn)});
+}
+
+void OutputQueue::write(unsigned jobs, bool verbose) {
+  auto outputs = std::move(_outputs);
+  _outputs.clear();
+  std::vector<std::exception_ptr> errors(outputs.size());
+
+  parallel_for(outputs.size(), jobs, [&](size_t i) {
+    auto& output = outputs[i];
+    SFC_TRACE_SPAN(output.trace_name, output.path);
+    const auto start = std::chrono::steady_clock::now();
+    try {
+      output.write_fn(output.path);
+    } catch (...) {
+      errors[i] = std::current_exception();
+      return;
+    }
+    output.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    std::error_code ec;
+    const auto size = std::filesystem::file_size(output.path, ec);
+    output.bytes = ec ? 0 : size;
+  });
+
+  if (verbose) {
+    for (size_t i = 0; i < outputs.size(); ++i) {
+      if (!errors[i])
+        fmt::print("Saved {} to \"{}\" ({} bytes in {:.2f} ms)\n", outputs[i].description, outputs[i].path, outputs[i].bytes,
+                   outputs[i].milliseconds);
+    }
+  }
+
+  for (const auto& error : errors) {
+    if (error)
+      std::rethrow_exception(error);
+  }
+}
+
+} /* namespace sfc */
@@ -0,0 +1,36 @@
+// concurrent output writing
+//
+// david lindecrantz <optiroc@me.com>
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace sfc {
+
+// independent outputs of a command, queued and then written concurrently
+// write functions save to the given path (atomically, through write_file or OutputFile) and must not share mutable state
+struct OutputQueue final {
+  void add(const char* trace_name, const std::string& description, const std::string& path,
+           std::function<void(const std::string&)> write_fn);
+
+  // write queued outputs on up to jobs threads, reporting size and time of each written output in queued order when verbose
+  // if any output fails the remaining outputs are still written, then the error of the first failing output is thrown
+  void write(unsigned jobs, bool verbose);
+
+private:
+  struct Output final {
+    const char* trace_name;
+    std::string description;
+    std::string path;
+    std::function<void(const std::string&)> write_fn;
+    uintmax_t bytes = 0;
+    double milliseconds = 0;
+  };
+
+  std::vector<Output> _outputs;
+};
+
+} /* namespace sfc */
@@ -1,4 +1,12 @@
 #include "Palette.h"
+#include "JsonWriter.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <cstdlib>
+#include <sstream>
 
 namespace sfc {
 
@@ -12,8 +20,12 @@ void Subpalette::add(rgba_t color, bool add_duplicates) {
     if (is_full())
       throw std::runtime_error("Colors don't fit in palette");
     _colors.push_back(color);
+  } else {
+    return;
   }
   _colors_set.insert(color);
+  _normalized_index.emplace(normalize_color(color, _mode), (unsigned)_colors.size() - 1);
+  update_shared_colors();
 }
 
 // add vector of colors
@@ -21,6 +33,8 @@ void Subpalette::add(const rgba_vec_t& new_colors, bool add_duplicates, bool ove
   if (overwrite) {
     _colors.clear();
     _colors_set.clear();
+    _normalized_index.clear();
+    update_shared_colors();
   }
   for (auto c : new_colors)
     add(c, add_duplicates);
@@ -31,6 +45,7 @@ void Subpalette::set(unsigned index, const rgba_t color) {
   if (_colors.size() > index) {
     _colors[index] = color;
     _colors_set = rgba_set_t(_colors.begin(), _colors.end());
+    update_index();
   }
 }
 
@@ -51,14 +66,18 @@ unsigned Subpalette::diff(const rgba_set_t& new_colors) const {
 }
 
 // sort colors, keeping color at index 0
-void Subpalette::sort() {
+void Subpalette::sort(const color_order_t& order, const ColorUsage& usage) {
   if (_colors.size() < 3)
     return;
   rgba_vec_t vc(_colors.begin() + 1, _colors.end());
   _colors.resize(1);
-  sort_colors(vc);
-  std::reverse(vc.begin(), vc.end());
+  if (order) {
+    order(vc, usage);
+  } else {
+    hue_order(vc, usage);
+  }
   _colors.insert(_colors.end(), vc.begin(), vc.end());
+  update_index();
 }
 
 // if there are duplicates of color zero, set alpha of color zero to 0
@@ -68,40 +87,195 @@ bool Subpalette::check_col0_duplicates() {
   if (std::find(std::next(_colors.begin()), _colors.end(), _colors[0]) != _colors.end()) {
     _colors[0] = _colors[0] & 0x00ffffff;
     _colors_set = rgba_set_t(_colors.begin(), _colors.end());
+    update_index();
     return true;
   }
   return false;
 }
 
+// rebuild normalized color index after reordering or replacing colors
+void Subpalette::update_index() {
+  _normalized_index.clear();
+  for (unsigned i = 0; i < _colors.size(); ++i)
+    _normalized_index.emplace(normalize_color(_colors[i], _mode), i);
+  update_shared_colors();
+}
+
+// new handle rather than modifying the old one, which tiles remapped before the change still reference
+void Subpalette::update_shared_colors() {
+  _shared_normalized_colors = std::make_shared<const rgba_vec_t>(normalized_colors());
+}
+
+
+namespace {
+
+enum class PaletteFormat {
+  json,
+  act,
+  gpl,
+  jasc,
+  native,
+};
+
+const char* palette_format_name(PaletteFormat format) {
+  switch (format) {
+  case PaletteFormat::json:
+    return "JSON";
+  case PaletteFormat::act:
+    return "ACT";
+  case PaletteFormat::gpl:
+    return "GPL";
+  case PaletteFormat::jasc:
+    return "JASC";
+  case PaletteFormat::native:
+    return "native";
+  }
+  return "";
+}
+
+bool starts_with(const byte_vec_t& data, size_t offset, const std::string& prefix) {
+  return data.size() >= offset + prefix.size() && std::equal(prefix.begin(), prefix.end(), data.begin() + offset);
+}
+
+// detect palette file format from content, and from extension for headerless act files
+PaletteFormat palette_format(const byte_vec_t& data, const std::string& path) {
+  size_t offset = starts_with(data, 0, "\xef\xbb\xbf") ? 3 : 0;
+  if (starts_with(data, offset, "GIMP Palette"))
+    return PaletteFormat::gpl;
+  if (starts_with(data, offset, "JASC-PAL"))
+    return PaletteFormat::jasc;
+
+  while (offset < data.size() && std::isspace(data[offset]))
+    ++offset;
+  if (offset < data.size() && data[offset] == '{')
+    return PaletteFormat::json;
+
+  std::string extension = path.size() > 4 ? path.substr(path.size() - 4) : std::string();
+  std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return std::tolower(c); });
+  if (extension == ".act" && (data.size() == 768 || data.size() == 772))
+    return PaletteFormat::act;
+
+  return PaletteFormat::native;
+}
+
+// adobe color table: 256 rgb triplets, optionally followed by big endian color count and transparent index
+rgba_vec_t act_colors(const byte_vec_t& data) {
+  unsigned count = 256;
+  unsigned transparent_index = 0xffff;
+  if (data.size() == 772) {
+    count = (data[768] << 8) | data[769];
+    transparent_index = (data[770] << 8) | data[771];
+    if (count == 0 || count > 256)
+      count = 256;
+  }
+
+  rgba_vec_t colors;
+  for (unsigned i = 0; i < count; ++i) {
+    rgba_t alpha = i == transparent_index ? 0 : 0xff000000;
+    colors.push_back(alpha | data[i * 3] | (data[i * 3 + 1] << 8) | (data[i * 3 + 2] << 16));
+  }
+  return colors;
+}
+
+// gimp (.gpl) and paint shop pro (jasc .pal) text palettes, one "r g b" color per line after the header
+rgba_vec_t text_palette_colors(const byte_vec_t& data, PaletteFormat format) {
+  std::istringstream in(std::string(data.begin(), data.end()));
+  std::string line;
+  unsigned line_number = 0;
+  unsigned jasc_count = 0;
+  rgba_vec_t colors;
+
+  while (std::getline(in, line)) {
+    ++line_number;
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    if (line_number == 1)
+      continue;
+
+    if (format == PaletteFormat::jasc) {
+      // version and color count lines
+      if (line_number == 2)
+        continue;
+      if (line_number == 3) {
+        jasc_count = (unsigned)std::strtoul(line.c_str(), nullptr, 10);
+        continue;
+      }
+    } else if (line.empty() || line[0] == '#' || line.find(':') != std::string::npos) {
+      // comments and "Name:"/"Columns:" attributes
+      continue;
+    }
+
+    std::istringstream ls(line);
+    int r, g, b;
+    if (!(ls >> r >> g >> b)) {
+      if (line.find_first_not_of(" \t") == std::string::npos)
+        continue;
+      throw std::runtime_error(fmt::format("Malformed color at line {} in palette", line_number));
+    }
+    if (r < 0 || r > 255 || g < 0 || g > 255 || b < 0 || b > 255)
+      throw std::runtime_error(fmt::format("Color out of range at line {} in palette", line_number));
+    colors.push_back(0xff000000 | r | (g << 8) | (b << 16));
+  }
+
+  if (format == PaletteFormat::jasc && jasc_count != colors.size())
+    throw std::runtime_error("Color count in JASC palette doesn't match colors");
+  return colors;
+}
+
+} // namespace
 
-// construct Palette by deserializing json or binary
+// construct Palette by deserializing json, act, gpl, jasc or native data
 Palette::Palette(const std::string& path, Mode in_mode, uint32_t colors_per_subpalette) {
+  SFC_TRACE_SPAN("load palette", path);
   _mode = in_mode;
   _max_colors_per_subpalette = colors_per_subpalette;
   _max_subpalettes = 64;
 
-  try {
-    // load json
-    auto j = read_json_file(path);
-    auto jp = j["palettes"];
-    for (const auto& jsp : jp) {
-      rgba_vec_t colors;
-      for (const auto& jcs : jsp) {
-        if (jcs.is_string())
-          colors.push_back(reduce_color(from_hexstring(jcs), in_mode));
+  const byte_vec_t data = read_binary(path);
+  PaletteFormat format = palette_format(data, path);
+
+  switch (format) {
+  case PaletteFormat::json:
+    try {
+      auto j = nlohmann::json::parse(data.begin(), data.end());
+      auto jp = j["palettes"];
+      for (const auto& jsp : jp) {
+        rgba_vec_t colors;
+        for (const auto& jcs : jsp) {
+          if (jcs.is_string())
+            colors.push_back(reduce_color(from_hexstring(jcs), in_mode));
+        }
+        if (colors.size() > _max_colors_per_subpalette)
+          throw std::runtime_error("Palette in JSON doesn't match color depth / colors per subpalette");
+        add_colors(colors, false);
       }
-      if (colors.size() > _max_colors_per_subpalette)
-        throw std::runtime_error("Palette in JSON doesn't match color depth / colors per subpalette");
-      add_colors(colors, false);
+    } catch (...) {
+      // not palette json after all, load as native data
+      format = PaletteFormat::native;
+      add_colors(unpack_native_colors(data, in_mode), false);
+      check_col0_duplicates();
     }
-  } catch (...) {
-    // load binary
-    add_colors(unpack_native_colors(read_binary(path), in_mode), false);
+    break;
+
+  case PaletteFormat::act:
+    add_colors(act_colors(data));
+    check_col0_duplicates();
+    break;
+
+  case PaletteFormat::gpl:
+  case PaletteFormat::jasc:
+    add_colors(text_palette_colors(data, format));
+    check_col0_duplicates();
+    break;
+
+  case PaletteFormat::native:
+    add_colors(unpack_native_colors(data, in_mode), false);
     check_col0_duplicates();
+    break;
   }
 
   if (_subpalettes.empty())
-    throw std::runtime_error("No palette data in JSON");
+    throw std::runtime_error(fmt::format("No palette data in {} file", palette_format_name(format)));
 }
 
 // construct Palette from native data
@@ -142,6 +316,7 @@ const std::vector<rgba_vec_t> Palette::normalized_colors() const {
 void Palette::set_color(unsigned index, const rgba_t color) {
   for (auto& sp : _subpalettes)
     sp.set(index, color);
+  update_color_ids();
 }
 
 // set color to be used at index 0 for subsequently created SubPalettes
@@ -158,31 +333,59 @@ void Palette::check_col0_duplicates() {
       fixed |= sp.check_col0_duplicates();
     if (fixed)
       fmt::print("Palette contains duplicates of color zero, treating color zero as transparent\n");
+    update_color_ids();
   }
 }
 
 // add optimized subpalettes containing colors in palette_tiles
-void Palette::add_images(std::vector<sfc::Image> palette_tiles) {
+void Palette::add_images(const std::vector<sfc::Image>& palette_tiles) {
 
-  // make vector of sets of all tiles' colors
-  rgba_set_vec_t palettes = rgba_set_vec_t();
+  // make vector of sets of all tiles' colors, allocated along with optimizer temporaries in an arena
+  Arena arena;
+  pmr::rgba_set_vec_t palettes(arena.resource());
   for (const auto& c : palette_tiles) {
+    warn_color_count(c.color_count(), c.src_coord_x(), c.src_coord_y());
 
-    if (c.colors().size() > _max_colors_per_subpalette) {
-      fmt::print(stderr, "  Tile with too many ({} > {}) unique colors at {},{} in source image\n", c.colors().size(), _max_colors_per_subpalette, c.src_coord_x(), c.src_coord_y());
-    }
+    auto& reduced = palettes.emplace_back();
+    for (const rgba_t color : c.colors())
+      reduced.insert(reduce_color(color, _mode));
+    if (_col0_is_shared)
+      reduced.insert(reduce_color(_col0, _mode));
+  }
 
-    if (_col0_is_shared) {
-      auto colors = c.colors();
-      colors.insert(_col0);
-      palettes.push_back(reduce_colors(colors, _mode));
-    } else {
-      palettes.push_back(reduce_colors(c.colors(), _mode));
-    }
+  add_optimized(palettes);
+}
+
+// add palettes for tiles of grid, using its precomputed reduced colors
+// tiles repeating an earlier tile are skipped, their colors would be discarded as redundant by the optimizer
+void Palette::add_images(const TileGrid& grid) {
+  Arena arena;
+  pmr::rgba_set_vec_t palettes(arena.resource());
+  const rgba_t reduced_col0 = reduce_color(_col0, _mode);
+  for (unsigned i = 0; i < grid.size(); ++i) {
+    warn_color_count(grid.color_count(i), grid.x(i), grid.y(i));
+    if (grid.first_identical(i) != i)
+      continue;
+
+    const auto reduced = grid.reduced_colors(i);
+    palettes.emplace_back(reduced.begin(), reduced.end());
+    if (_col0_is_shared)
+      palettes.back().insert(reduced_col0);
   }
 
-  // optimize
-  auto optimized = optimized_palettes(palettes);
+  add_optimized(palettes);
+}
+
+void Palette::warn_color_count(unsigned color_count, unsigned x, unsigned y) const {
+  if (color_count > _max_colors_per_subpalette) {
+    fmt::print(stderr, "  Tile with too many ({} > {}) unique colors at {},{} in source image\n", color_count,
+               _max_colors_per_subpalette, x, y);
+  }
+}
+
+// add optimized subpalettes covering each set of reduced tile colors
+void Palette::add_optimized(const pmr::rgba_set_vec_t& tile_colors) {
+  auto optimized = optimized_palettes(tile_colors);
 
   // TODO: if throw iterate all palette_tiles and report positions
   if (optimized.size() > _max_subpalettes)
@@ -201,6 +404,7 @@ void Palette::add_images(std::vector<sfc::Image> palette_tiles) {
 
     sp.add(cv);
   }
+  update_color_ids();
 }
 
 void Palette::add_colors(const rgba_vec_t& colors, bool reduce_depth) {
@@ -213,9 +417,28 @@ void Palette::add_colors(const rgba_vec_t& colors, bool reduce_depth) {
     sp.add(sv, true);
     _subpalettes.push_back(sp);
   }
+  update_color_ids();
 }
 
 
+index_t Subpalette::remap_index(rgba_t color) const {
+  if (_colors.empty())
+    throw std::runtime_error("No colors");
+  return remap_reduced_index(reduce_color(color, _mode));
+}
+
+index_t Subpalette::remap_reduced_index(rgba_t reduced_color) const {
+  if (_colors.empty())
+    throw std::runtime_error("No colors");
+  const rgba_t color = normalize_color(reduced_color, _mode);
+  if (color == transparent_color)
+    return 0;
+  const int index = index_of(color);
+  if (index < 0)
+    throw std::runtime_error("Color not in palette");
+  return (index_t)index;
+}
+
 int Palette::index_of(const Subpalette& subpalette) const {
   for (int i = 0; i < (int)_subpalettes.size(); ++i) {
     if (subpalette.colors() == _subpalettes[i].colors())
@@ -226,48 +449,212 @@ int Palette::index_of(const Subpalette& subpalette) const {
 
 // get first subpalette containing all colors in image
 const Subpalette& Palette::subpalette_matching(const Image& image) const {
-  auto rc = reduce_colors(image.rgba_data(), _mode);
-  rgba_set_t cs(rc.begin(), rc.end());
-  cs.erase(transparent_color);
+  std::vector<uint64_t> signature;
+  bool in_palette;
+  const unsigned color_count = color_signature(image, true, signature, in_palette);
+  return subpalette_matching(signature, in_palette, color_count, image.src_coord_x(), image.src_coord_y());
+}
 
-  if (cs.size() > _max_colors_per_subpalette) {
-    throw std::runtime_error(
-      fmt::format("Tile with too many ({} > {}) unique colors at {},{} in source image", cs.size(), _max_colors_per_subpalette, image.src_coord_x(), image.src_coord_y()));
+const Subpalette& Palette::subpalette_matching(const TileGrid& grid, unsigned index) const {
+  std::vector<uint64_t> signature;
+  bool in_palette;
+  const unsigned color_count = color_signature(grid.reduced_colors(index), true, signature, in_palette);
+  return subpalette_matching(signature, in_palette, color_count, grid.x(index), grid.y(index));
+}
+
+const Subpalette& Palette::subpalette_matching(const std::vector<uint64_t>& signature, bool in_palette, unsigned color_count,
+                                               unsigned x, unsigned y) const {
+  if (color_count > _max_colors_per_subpalette) {
+    throw std::runtime_error(fmt::format("Tile with too many ({} > {}) unique colors at {},{} in source image", color_count,
+                                         _max_colors_per_subpalette, x, y));
   }
 
-  auto match = std::find_if(_subpalettes.begin(), _subpalettes.end(), [&](const auto& val) -> bool { return val.diff(cs) == 0; });
+  auto match = _subpalettes.end();
+  if (in_palette)
+    match = std::find_if(_subpalettes.begin(), _subpalettes.end(), [&](const auto& val) -> bool { return val.covers(signature); });
 
-  if (match == _subpalettes.end()) {
-    throw std::runtime_error(
-      fmt::format("No matching palette for tile at {},{} in source image", image.src_coord_x(), image.src_coord_y()));
-  }
+  if (match == _subpalettes.end())
+    throw std::runtime_error(fmt::format("No matching palette for tile at {},{} in source image", x, y));
 
   return *match;
 }
 
 std::vector<const Subpalette*> Palette::subpalettes_matching(const Image& image) const {
-  std::vector<const Subpalette*> sv;
+  std::vector<uint64_t> signature;
+  bool in_palette;
+  const unsigned color_count = color_signature(image, false, signature, in_palette);
+  return subpalettes_matching(signature, in_palette, color_count, image.src_coord_x(), image.src_coord_y());
+}
+
+std::vector<const Subpalette*> Palette::subpalettes_matching(const TileGrid& grid, unsigned index) const {
+  std::vector<uint64_t> signature;
+  bool in_palette;
+  const unsigned color_count = color_signature(grid.reduced_colors(index), false, signature, in_palette);
+  return subpalettes_matching(signature, in_palette, color_count, grid.x(index), grid.y(index));
+}
 
-  auto rc = reduce_colors(image.rgba_data(), _mode);
-  rgba_set_t cs(rc.begin(), rc.end());
+std::vector<const Subpalette*> Palette::subpalettes_matching(const std::vector<uint64_t>& signature, bool in_palette,
+                                                             unsigned color_count, unsigned x, unsigned y) const {
+  if (color_count > _max_colors_per_subpalette)
+    throw std::runtime_error(fmt::format("Tile with too many unique colors at {},{} in source image\n", x, y));
 
-  if (cs.size() > _max_colors_per_subpalette) {
-    throw std::runtime_error(
-      fmt::format("Tile with too many unique colors at {},{} in source image\n", image.src_coord_x(), image.src_coord_y()));
+  std::vector<const Subpalette*> sv;
+  if (in_palette) {
+    for (const Subpalette& sp : _subpalettes) {
+      if (sp.covers(signature))
+        sv.push_back(&sp);
+    }
   }
+  return sv;
+}
 
-  for (const Subpalette& sp : _subpalettes) {
-    if (sp.diff(cs) == 0)
-      sv.push_back(&sp);
+
+void Palette::sort(const color_order_t& order, const TileGrid* grid) {
+  std::vector<ColorUsage> usage(_subpalettes.size());
+  if (order && grid)
+    usage = color_usage(*grid);
+  for (size_t i = 0; i < _subpalettes.size(); ++i)
+    _subpalettes[i].sort(order, usage[i]);
+  _generation = unique_serial();
+}
+
+// usage of each subpalette's colors by the tiles of grid, with each tile counted in the first subpalette covering it
+// tiles not covered by any subpalette are left out
+std::vector<ColorUsage> Palette::color_usage(const TileGrid& grid) const {
+  SFC_TRACE_SPAN("color usage");
+  std::vector<ColorUsage> usage(_subpalettes.size());
+
+  // distinct tiles are counted once for each occurrence
+  std::vector<unsigned> occurrences(grid.size(), 0);
+  for (unsigned i = 0; i < grid.size(); ++i)
+    ++occurrences[grid.first_identical(i)];
+
+  std::vector<uint64_t> signature;
+  for (unsigned i = 0; i < grid.size(); ++i) {
+    const unsigned count = occurrences[i];
+    if (count == 0)
+      continue;
+
+    const auto colors = grid.reduced_colors(i);
+    bool in_palette;
+    color_signature(colors, true, signature, in_palette);
+    auto match = _subpalettes.end();
+    if (in_palette)
+      match = std::find_if(_subpalettes.begin(), _subpalettes.end(), [&](const auto& sp) { return sp.covers(signature); });
+    if (match == _subpalettes.end())
+      continue;
+    ColorUsage& u = usage[match - _subpalettes.begin()];
+
+    const unsigned width = grid.tile_width();
+    const unsigned height = grid.tile_height();
+    const auto ids = grid.color_ids(i);
+
+    auto add_neighbors = [&](rgba_t a, rgba_t b) {
+      if (a != b)
+        u.neighbors[std::minmax(a, b)] += count;
+    };
+    for (unsigned y = 0; y < height; ++y) {
+      for (unsigned x = 0; x < width; ++x) {
+        const rgba_t color = colors[ids[y * width + x]];
+        u.pixels[color] += count;
+        if (x + 1 < width)
+          add_neighbors(color, colors[ids[y * width + x + 1]]);
+        if (y + 1 < height)
+          add_neighbors(color, colors[ids[(y + 1) * width + x]]);
+      }
+    }
   }
+  return usage;
+}
 
-  return sv;
+// ascending hue order
+void hue_order(rgba_vec_t& colors, const ColorUsage&) {
+  sort_colors(colors);
+  std::reverse(colors.begin(), colors.end());
 }
 
+// most used colors first, colors used equally often in hue order
+void frequency_order(rgba_vec_t& colors, const ColorUsage& usage) {
+  hue_order(colors, usage);
+  auto pixels = [&](rgba_t color) {
+    auto it = usage.pixels.find(color);
+    return it != usage.pixels.end() ? it->second : 0;
+  };
+  std::stable_sort(colors.begin(), colors.end(), [&](rgba_t a, rgba_t b) { return pixels(a) > pixels(b); });
+}
 
-void Palette::sort() {
-  for (auto& sp : _subpalettes)
-    sp.sort();
+// order with few bit plane transitions, ie. few differing index bits between neighboring pixels
+// starting from frequency order, pairs of colors are swapped for as long as that lowers the transition count
+void plane_order(rgba_vec_t& colors, const ColorUsage& usage) {
+  frequency_order(colors, usage);
+  const size_t n = colors.size();
+  if (n < 2 || usage.neighbors.empty())
+    return;
+
+  // neighbor counts between colors by position in colors, with position n standing for colors at index 0
+  std::unordered_map<rgba_t, size_t> position;
+  for (size_t i = 0; i < n; ++i)
+    position.emplace(colors[i], i);
+  auto position_of = [&](rgba_t color) {
+    auto it = position.find(color);
+    return it != position.end() ? it->second : n;
+  };
+  const size_t stride = n + 1;
+  std::vector<int64_t> weight(stride * stride, 0);
+  for (const auto& [pair, count] : usage.neighbors) {
+    const size_t a = position_of(pair.first);
+    const size_t b = position_of(pair.second);
+    if (a == b)
+      continue;
+    weight[a * stride + b] += count;
+    weight[b * stride + a] += count;
+  }
+
+  std::vector<unsigned> index(stride);
+  for (size_t i = 0; i < n; ++i)
+    index[i] = (unsigned)i + 1;
+  index[n] = 0;
+
+  // swapping indices of a and b leaves their mutual transitions unchanged
+  auto swap_gain = [&](size_t a, size_t b) {
+    int64_t gain = 0;
+    for (size_t c = 0; c < stride; ++c) {
+      if (c == a || c == b)
+        continue;
+      const int64_t change = std::popcount(index[b] ^ index[c]) - std::popcount(index[a] ^ index[c]);
+      gain -= (weight[a * stride + c] - weight[b * stride + c]) * change;
+    }
+    return gain;
+  };
+
+  const unsigned max_passes = 16;
+  bool improved = true;
+  for (unsigned pass = 0; improved && pass < max_passes; ++pass) {
+    improved = false;
+    for (size_t a = 0; a < n; ++a) {
+      for (size_t b = a + 1; b < n; ++b) {
+        if (swap_gain(a, b) > 0) {
+          std::swap(index[a], index[b]);
+          improved = true;
+        }
+      }
+    }
+  }
+
+  rgba_vec_t ordered(n);
+  for (size_t i = 0; i < n; ++i)
+    ordered[index[i] - 1] = colors[i];
+  colors = std::move(ordered);
+}
+
+color_order_t color_order(const std::string& name) {
+  if (name == "hue")
+    return {};
+  if (name == "frequency")
+    return frequency_order;
+  if (name == "planes")
+    return plane_order;
+  throw std::runtime_error(fmt::format("Unknown color order \"{}\" (expected hue, frequency or planes)", name));
 }
 
 
@@ -294,43 +681,49 @@ const std::string Palette::description() const {
 }
 
 const std::string Palette::to_json() const {
-  nlohmann::json j;
+  std::ostringstream out;
+  write_json(out);
+  return out.str();
+}
 
-  {
-    auto ps = normalized_colors();
-    std::vector<std::vector<std::string>> jps;
+void Palette::save_json(const std::string& path) const {
+  OutputFile file(path, false);
+  write_json(file.stream());
+  file.commit();
+}
 
-    for (const auto& p : ps) {
-      std::vector<std::string> jp;
-      for (const auto& c : p)
-        jp.push_back(to_hexstring(c));
-      jps.push_back(jp);
-    }
+// stream json palette data, formatted as a json document dumped with indent 2
+void Palette::write_json(std::ostream& out) const {
+  JsonWriter json(out);
+  json.begin_object();
 
-    j["palettes"] = jps;
+  json.key("palettes");
+  json.begin_array();
+  for (const auto& sp : _subpalettes) {
+    json.begin_array();
+    for (const auto& c : sp.normalized_colors())
+      json.value(to_hexstring(c));
+    json.end_array();
   }
+  json.end_array();
 
-  {
-    auto ps = colors();
-    std::vector<std::vector<std::vector<unsigned>>> jps;
-
-    for (const auto& p : ps) {
-      std::vector<std::vector<unsigned>> jp;
-      for (const auto& c : p) {
-        std::vector<unsigned> jpt;
-        auto rgb = rgba_color(c);
-        jpt.push_back(rgb.r);
-        jpt.push_back(rgb.g);
-        jpt.push_back(rgb.b);
-        jp.push_back(jpt);
-      }
-      jps.push_back(jp);
+  json.key("palettes_native_rgb");
+  json.begin_array();
+  for (const auto& sp : _subpalettes) {
+    json.begin_array();
+    for (const auto& c : sp.colors()) {
+      auto rgb = rgba_color(c);
+      json.begin_array();
+      json.value((unsigned)rgb.r);
+      json.value((unsigned)rgb.g);
+      json.value((unsigned)rgb.b);
+      json.end_array();
     }
-
-    j["palettes_native_rgb"] = jps;
+    json.end_array();
   }
+  json.end_array();
 
-  return j.dump(2);
+  json.end_object();
 }
 
 void Palette::save(const std::string& path) const {
@@ -376,31 +769,120 @@ Subpalette& Palette::add_subpalette() {
   return sp;
 }
 
+// assign palette-wide ids to all colors and update subpalette color bitsets, after any change to subpalette colors
+void Palette::update_color_ids() {
+  _generation = unique_serial();
+  _color_ids.clear();
+  for (const auto& sp : _subpalettes) {
+    for (auto c : sp._colors)
+      _color_ids.emplace(c, (unsigned)_color_ids.size());
+  }
+
+  _color_words = (unsigned)(_color_ids.size() + 63) / 64;
+  for (auto& sp : _subpalettes) {
+    sp._color_bits.assign(_color_words, 0);
+    for (auto c : sp._colors) {
+      const unsigned id = _color_ids.at(c);
+      sp._color_bits[id >> 6] |= (uint64_t)1 << (id & 63);
+    }
+  }
+}
+
+// set color id bits of image's reduced colors in signature and return its number of unique colors
+// in_palette is cleared if any color has no id, in which case no subpalette covers the image
+unsigned Palette::color_signature(const Image& image, bool ignore_transparent, std::vector<uint64_t>& signature,
+                                  bool& in_palette) const {
+  signature.assign(_color_words, 0);
+  in_palette = true;
+  unsigned count = 0;
+  rgba_set_t unknown;
+
+  const unsigned size = image.width() * image.height();
+  rgba_t previous = 0;
+  for (unsigned i = 0; i < size; ++i) {
+    const rgba_t source_color = image.rgba_color_at(i);
+    if (i > 0 && source_color == previous)
+      continue;
+    previous = source_color;
+
+    const rgba_t color = reduce_color(source_color, _mode);
+    if (ignore_transparent && color == transparent_color)
+      continue;
+
+    auto id = _color_ids.find(color);
+    if (id == _color_ids.end()) {
+      in_palette = false;
+      unknown.insert(color);
+      continue;
+    }
+    uint64_t& word = signature[id->second >> 6];
+    const uint64_t bit = (uint64_t)1 << (id->second & 63);
+    count += (word & bit) ? 0 : 1;
+    word |= bit;
+  }
+
+  return count + (unsigned)unknown.size();
+}
+
+// same as color_signature(image) for unique colors already reduced to mode color depth
+unsigned Palette::color_signature(std::span<const rgba_t> reduced_colors, bool ignore_transparent,
+                                  std::vector<uint64_t>& signature, bool& in_palette) const {
+  signature.assign(_color_words, 0);
+  in_palette = true;
+  unsigned count = 0;
+  for (const rgba_t color : reduced_colors) {
+    if (ignore_transparent && color == transparent_color)
+      continue;
+    ++count;
+    auto id = _color_ids.find(color);
+    if (id == _color_ids.end()) {
+      in_palette = false;
+      continue;
+    }
+    signature[id->second >> 6] |= (uint64_t)1 << (id->second & 63);
+  }
+  return count;
+}
+
 // functional form of old "greedy best fit" style palette optimizer
-const rgba_set_vec_t Palette::optimized_palettes(const rgba_set_vec_t& colors) const {
+// intermediate sets are allocated from the allocator of colors
+const rgba_set_vec_t Palette::optimized_palettes(const pmr::rgba_set_vec_t& colors) const {
+  SFC_TRACE_SPAN("optimize palettes");
+  const auto allocator = colors.get_allocator();
 
-  auto filter_subsets = [](const rgba_set_vec_t& v) {
-    auto n = rgba_set_vec_t(v.size());
+  auto filter_subsets = [&](const pmr::rgba_set_vec_t& v) {
+    auto n = pmr::rgba_set_vec_t(v.size(), allocator);
     auto it = std::copy_if(v.begin(), v.end(), n.begin(), [&](const auto& s) { return !has_superset(s, v); });
     n.resize(std::distance(n.begin(), it));
     return n;
   };
 
-  auto filter_redundant = [](const rgba_set_vec_t& v) {
-    auto n = rgba_set_vec_t(v.size());
+  auto filter_redundant = [&](const pmr::rgba_set_vec_t& v) {
+    auto n = pmr::rgba_set_vec_t(v.size(), allocator);
     auto it = std::copy_if(v.begin(), v.end(), n.begin(),
                            [&](auto& s) { return s.size() < 1 ? false : std::find(n.begin(), n.end(), s) == n.end(); });
     n.resize(std::distance(n.begin(), it));
     return n;
   };
 
-  auto best_fit = [&](const rgba_set_t& s, const rgba_set_vec_t& v) {
+  // number of colors in s missing from cs
+  auto difference_size = [](const pmr::rgba_set_t& s, const pmr::rgba_set_t& cs) {
+    size_t count = 0;
+    auto it = cs.begin();
+    for (const rgba_t c : s) {
+      while (it != cs.end() && *it < c)
+        ++it;
+      if (it == cs.end() || *it != c)
+        ++count;
+    }
+    return count;
+  };
+
+  auto best_fit = [&](const pmr::rgba_set_t& s, const pmr::rgba_set_vec_t& v) {
     int best = -1;
     unsigned i = 0;
     for (auto& cs : v) {
-      rgba_set_t d;
-      std::set_difference(s.begin(), s.end(), cs.begin(), cs.end(), std::inserter(d, d.begin()));
-      if (d.size() + cs.size() <= _max_colors_per_subpalette)
+      if (difference_size(s, cs) + cs.size() <= _max_colors_per_subpalette)
         best = i;
       ++i;
     }
@@ -411,20 +893,24 @@ const rgba_set_vec_t Palette::optimized_palettes(const rgba_set_vec_t& colors) c
   sets = filter_subsets(sets);
   std::sort(sets.begin(), sets.end(), [](auto& a, auto& b) { return a.size() < b.size(); });
 
-  rgba_set_vec_t opt = rgba_set_vec_t();
+  pmr::rgba_set_vec_t opt(allocator);
 
   while (sets.size()) {
     auto set = vec_pop(sets);
     auto best_index = best_fit(set, opt);
     if (best_index == -1) {
-      opt.push_back(set);
+      opt.push_back(std::move(set));
     } else {
       opt[best_index].insert(set.begin(), set.end());
     }
   }
 
   std::sort(opt.begin(), opt.end(), [](auto& a, auto& b) -> bool { return a.size() > b.size(); });
-  return opt;
+
+  rgba_set_vec_t optimized;
+  for (const auto& s : opt)
+    optimized.emplace_back(s.begin(), s.end());
+  return optimized;
 }
 
 } /* namespace sfc */
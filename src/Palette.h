@@ -4,6 +4,10 @@
 
 #pragma once
 
+#include <memory>
+#include <span>
+#include <unordered_map>
+
 #include "Common.h"
 #include "Image.h"
 #include "Mode.h"
@@ -11,6 +15,7 @@
 namespace sfc {
 
 struct Image;
+struct TileGrid;
 
 struct Subpalette final {
   Subpalette(Mode mode, unsigned max_colors) : _mode(mode), _max_colors(max_colors){};
@@ -22,13 +27,38 @@ struct Subpalette final {
   const rgba_vec_t colors() const { return _colors; }
   const rgba_vec_t normalized_colors() const { return normalize_colors(_colors, _mode); }
 
+  // normalized colors in a handle shared by all tiles remapped to subpalette, replaced whenever colors change
+  std::shared_ptr<const rgba_vec_t> shared_normalized_colors() const { return _shared_normalized_colors; }
+
+  // index of first color normalizing to normalized_color, or -1 if there is none
+  int index_of(rgba_t normalized_color) const {
+    auto it = _normalized_index.find(normalized_color);
+    return it != _normalized_index.end() ? (int)it->second : -1;
+  }
+
   void add(rgba_t color, bool add_duplicates = false);
   void add(const rgba_vec_t& new_colors, bool add_duplicates = false, bool overwrite = false);
   void set(unsigned index, const rgba_t color);
 
+  // index source color is mapped to when remapping an image to subpalette
+  index_t remap_index(rgba_t color) const;
+  // same as remap_index() for a color already reduced to mode color depth
+  index_t remap_reduced_index(rgba_t reduced_color) const;
+
   Subpalette padded() const;
   unsigned diff(const rgba_set_t& new_colors) const;
-  void sort();
+
+  // true if all color ids set in signature are in subpalette (ids assigned by owning palette)
+  bool covers(const std::vector<uint64_t>& signature) const {
+    for (size_t i = 0; i < signature.size(); ++i) {
+      if (signature[i] & ~_color_bits[i])
+        return false;
+    }
+    return true;
+  }
+
+  // arrange colors after color 0 in order, hue order if none is given
+  void sort(const color_order_t& order = {}, const ColorUsage& usage = {});
   bool check_col0_duplicates();
 
 private:
@@ -37,6 +67,18 @@ private:
 
   rgba_vec_t _colors;
   rgba_set_t _colors_set;
+
+  // normalized color -> index of its first occurrence in _colors
+  std::unordered_map<rgba_t, unsigned> _normalized_index;
+  std::shared_ptr<const rgba_vec_t> _shared_normalized_colors;
+
+  // bitset of palette-wide color ids, maintained by owning palette
+  std::vector<uint64_t> _color_bits;
+
+  void update_index();
+  void update_shared_colors();
+
+  friend struct Palette;
 };
 
 struct Palette final {
@@ -48,6 +90,9 @@ struct Palette final {
 
   unsigned max_colors_per_subpalette() const { return _max_colors_per_subpalette; }
   unsigned size() const;
+
+  // changes whenever subpalette colors or their order change
+  uint64_t generation() const { return _generation; }
   const std::vector<rgba_vec_t> colors() const;
   const std::vector<rgba_vec_t> normalized_colors() const;
 
@@ -55,17 +100,26 @@ struct Palette final {
   void prime_col0(const rgba_t color);
   void check_col0_duplicates();
 
-  void add_images(std::vector<sfc::Image>);
+  void add_images(const std::vector<sfc::Image>& palette_tiles);
+  void add_images(const TileGrid& grid);
   void add_colors(const rgba_vec_t& colors, bool reduce_depth = true);
 
   int index_of(const Subpalette& subpalette) const;
   const Subpalette& subpalette_matching(const Image& image) const;
   std::vector<const Subpalette*> subpalettes_matching(const Image& image) const;
 
-  void sort();
+  // same as matching a crop of tile at index of grid, using the reduced colors kept by grid
+  const Subpalette& subpalette_matching(const TileGrid& grid, unsigned index) const;
+  std::vector<const Subpalette*> subpalettes_matching(const TileGrid& grid, unsigned index) const;
+
+  // sort subpalettes in order, hue order if none is given
+  // orderings are passed how the tiles of grid use the colors of each subpalette, if grid is given
+  void sort(const color_order_t& order = {}, const TileGrid* grid = nullptr);
 
   const std::string description() const;
   const std::string to_json() const;
+  void write_json(std::ostream& out) const;
+  void save_json(const std::string& path) const;
   void save(const std::string& path) const;
   void save_act(const std::string& path) const;
 
@@ -74,14 +128,38 @@ private:
   unsigned _max_subpalettes = 0;
   unsigned _max_colors_per_subpalette = 0;
   std::vector<Subpalette> _subpalettes;
+  uint64_t _generation = unique_serial();
 
   rgba_t _col0 = 0;
   bool _col0_is_shared = false;
 
+  // palette-wide color ids, indexing subpalette color bitsets
+  std::unordered_map<rgba_t, unsigned> _color_ids;
+  unsigned _color_words = 0;
+
   Subpalette& add_subpalette();
+  void add_optimized(const pmr::rgba_set_vec_t& tile_colors);
+  void warn_color_count(unsigned color_count, unsigned x, unsigned y) const;
+  void update_color_ids();
+  unsigned color_signature(const Image& image, bool ignore_transparent, std::vector<uint64_t>& signature, bool& in_palette) const;
+  unsigned color_signature(std::span<const rgba_t> reduced_colors, bool ignore_transparent, std::vector<uint64_t>& signature,
+                           bool& in_palette) const;
+  const Subpalette& subpalette_matching(const std::vector<uint64_t>& signature, bool in_palette, unsigned color_count,
+                                        unsigned x, unsigned y) const;
+  std::vector<const Subpalette*> subpalettes_matching(const std::vector<uint64_t>& signature, bool in_palette,
+                                                      unsigned color_count, unsigned x, unsigned y) const;
+  std::vector<ColorUsage> color_usage(const TileGrid& grid) const;
   unsigned subpalettes_free() const { return _max_subpalettes - (unsigned)_subpalettes.size(); }
 
-  const rgba_set_vec_t optimized_palettes(const rgba_set_vec_t& colors) const;
+  const rgba_set_vec_t optimized_palettes(const pmr::rgba_set_vec_t& colors) const;
 };
 
+// color orderings for Subpalette::sort() and Palette::sort()
+void hue_order(rgba_vec_t& colors, const ColorUsage& usage);
+void frequency_order(rgba_vec_t& colors, const ColorUsage& usage);
+void plane_order(rgba_vec_t& colors, const ColorUsage& usage);
+
+// color ordering by name (hue, frequency or planes), empty for hue order which needs no usage data
+color_order_t color_order(const std::string& name);
+
 } /* namespace sfc */
@@ -0,0 +1,160 @@
+// parallel loop helpers
+//
+// david lindecrantz <optiroc@me.com>
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Trace.h"
+
+namespace sfc {
+
+// resolve requested job count, 0 meaning one per hardware thread
+inline unsigned resolve_jobs(unsigned jobs) {
+  if (jobs == 0)
+    jobs = std::thread::hardware_concurrency();
+  return jobs ? jobs : 1;
+}
+
+// call fn(i) for i in [0, count) on up to jobs threads (including the calling thread)
+// if any invocation throws, the exception from the lowest index is rethrown after all workers finish
+template <typename F>
+void parallel_for(size_t count, unsigned jobs, F&& fn) {
+  jobs = resolve_jobs(jobs);
+  if (jobs > count)
+    jobs = (unsigned)count;
+
+  if (jobs <= 1) {
+    for (size_t i = 0; i < count; ++i)
+      fn(i);
+    return;
+  }
+
+  std::atomic<size_t> next = 0;
+  std::atomic<size_t> first_error = count;
+  std::vector<size_t> error_index(jobs, count);
+  std::vector<std::exception_ptr> errors(jobs);
+
+  // workers take indices in increasing order, so the first failure of each worker is its lowest
+  // spawned workers are named in trace output, and each worker's share of the loop is recorded as a span
+  auto worker = [&](unsigned w) {
+    if (w > 0)
+      trace::set_thread_name("worker " + std::to_string(w));
+    SFC_TRACE_SPAN("parallel worker");
+    for (size_t i = next++; i < count; i = next++) {
+      if (i > first_error)
+        break;
+      try {
+        fn(i);
+      } catch (...) {
+        error_index[w] = i;
+        errors[w] = std::current_exception();
+        size_t current = first_error;
+        while (i < current && !first_error.compare_exchange_weak(current, i)) {
+        }
+        break;
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned w = 1; w < jobs; ++w)
+    threads.emplace_back(worker, w);
+  worker(0);
+  for (auto& t : threads)
+    t.join();
+
+  for (unsigned w = 0; w < jobs; ++w) {
+    if (errors[w] && error_index[w] == first_error)
+      std::rethrow_exception(errors[w]);
+  }
+}
+
+// call produce(i) for i in [0, count) on a separate thread, handing each result to consume(i, result) on the calling thread
+// in order, with at most depth results pending between the two stages
+// an exception from either stage stops the pipeline and is rethrown, items produced before a failure are still consumed
+template <typename Produce, typename Consume>
+void pipeline(size_t count, size_t depth, unsigned jobs, Produce&& produce, Consume&& consume) {
+  using T = decltype(produce(size_t()));
+
+  if (resolve_jobs(jobs) <= 1 || count <= 1) {
+    for (size_t i = 0; i < count; ++i)
+      consume(i, produce(i));
+    return;
+  }
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<T> pending;
+  std::exception_ptr produce_error;
+  bool produced_all = false;
+  bool stopped = false;
+
+  std::thread producer([&] {
+    trace::set_thread_name("pipeline producer");
+    for (size_t i = 0; i < count; ++i) {
+      try {
+        T item = [&] {
+          SFC_TRACE_SPAN("pipeline produce");
+          return produce(i);
+        }();
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return pending.size() < depth || stopped; });
+        if (stopped)
+          return;
+        pending.push_back(std::move(item));
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        produce_error = std::current_exception();
+        break;
+      }
+      changed.notify_all();
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    produced_all = true;
+    changed.notify_all();
+  });
+
+  auto stop = [&] {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopped = true;
+    }
+    changed.notify_all();
+    producer.join();
+  };
+
+  try {
+    for (size_t i = 0; i < count; ++i) {
+      std::optional<T> item;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return !pending.empty() || produced_all; });
+        if (pending.empty())
+          break;
+        item.emplace(std::move(pending.front()));
+        pending.pop_front();
+      }
+      changed.notify_all();
+      consume(i, std::move(*item));
+    }
+  } catch (...) {
+    stop();
+    throw;
+  }
+
+  stop();
+  if (produce_error)
+    std::rethrow_exception(produce_error);
+}
+
+} /* namespace sfc */
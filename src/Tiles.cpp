@@ -1,37 +1,117 @@
 #include "Tiles.h"
+#include "Parallel.h"
+#include "Trace.h"
 
 namespace sfc {
 
-Tile::Tile(const Image& image, Mode mode, unsigned bpp, bool no_flip)
-    : _mode(mode), _bpp(bpp), _width(image.width()), _height(image.height()), _palette(image.palette()) {
-  if (image.indexed_data().empty())
+Tile::Tile(const Image& image, Mode mode, unsigned bpp, bool no_flip, std::shared_ptr<const rgba_vec_t> palette)
+    : Tile(image.indexed_data(), mode, bpp, no_flip, image.width(), image.height(),
+           palette ? std::move(palette) : std::make_shared<const rgba_vec_t>(image.palette())) {}
+
+Tile::Tile(std::span<const index_t> data, Mode mode, unsigned bpp, bool no_flip, unsigned width, unsigned height,
+           std::shared_ptr<const rgba_vec_t> palette)
+    : _mode(mode), _bpp(bpp), _width(width), _height(height), _flippable(!no_flip), _palette(std::move(palette)) {
+  if (data.empty())
     throw std::runtime_error("Can't create tile without indexed data");
 
   index_t mask = bitmask_at_bpp(_bpp);
-  for (index_t ip : image.indexed_data())
+  _data.reserve(data.size());
+  for (index_t ip : data)
     _data.push_back(ip & mask);
+  slice();
+}
+
+namespace {
 
-  if (!no_flip) {
-    _mirrors.push_back(mirror(_data, _width, true, false));
-    _mirrors.push_back(mirror(_data, _width, false, true));
-    _mirrors.push_back(mirror(_data, _width, true, true));
+// true if other equals data mirrored
+bool mirrored_equal(const index_t* data, const index_t* other, unsigned width, unsigned height, bool horizontal, bool vertical) {
+  for (unsigned y = 0; y < height; ++y) {
+    const index_t* row = &data[(vertical ? height - 1 - y : y) * width];
+    const index_t* other_row = &other[y * width];
+    for (unsigned x = 0; x < width; ++x) {
+      if (row[horizontal ? width - 1 - x : x] != other_row[x])
+        return false;
+    }
   }
+  return true;
 }
 
-Tile::Tile(const byte_vec_t& native_data, Mode mode, unsigned bpp, bool no_flip, unsigned width, unsigned height)
-    : _mode(mode), _bpp(bpp), _width(width), _height(height), _data(unpack_native_tile(native_data, mode, bpp, width, height)) {
-  _palette.resize(palette_size_at_bpp(bpp));
-  channel_t add = 0x100 / _palette.size();
-  for (unsigned i = 0; i < _palette.size(); ++i) {
-    channel_t value = add * i;
-    _palette[i] = (rgba_t)(0xff000000 + value + (value << 8) + (value << 16));
+// compare tile pixels, with the common 8x8 and 16x16 sizes compiled as fixed size compares
+template <size_t Size>
+bool fixed_pixels_equal(const index_t* data, const index_t* other) {
+  return std::memcmp(data, other, Size) == 0;
+}
+
+bool pixels_equal(const index_t* data, const index_t* other, size_t size) {
+  switch (size) {
+  case std::tuple_size<tile_8x8_t>::value:
+    return fixed_pixels_equal<std::tuple_size<tile_8x8_t>::value>(data, other);
+  case std::tuple_size<tile_16x16_t>::value:
+    return fixed_pixels_equal<std::tuple_size<tile_16x16_t>::value>(data, other);
+  default:
+    return std::memcmp(data, other, size) == 0;
   }
+}
+
+// true if other equals data mirrored in some orientation, giving the first of h, v and hv that does in flipped
+// a fixed Width and Height compiles to fixed size loops, zero takes the size from width and height
+template <unsigned Width, unsigned Height>
+bool mirrored_match(const index_t* data, const index_t* other, unsigned width, unsigned height, TileFlipped& flipped) {
+  const unsigned w = Width ? Width : width;
+  const unsigned h = Height ? Height : height;
+  if (mirrored_equal(data, other, w, h, true, false)) {
+    flipped = {true, false};
+  } else if (mirrored_equal(data, other, w, h, false, true)) {
+    flipped = {false, true};
+  } else if (mirrored_equal(data, other, w, h, true, true)) {
+    flipped = {true, true};
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// hash of tile data in mirrored orientation
+uint64_t orientation_hash(const index_t* data, unsigned width, unsigned height, bool horizontal, bool vertical) {
+  if (!(horizontal || vertical))
+    return fnv1a(data, (size_t)width * height);
+
+  uint64_t h = fnv1a(nullptr, 0);
+  for (unsigned y = 0; y < height; ++y) {
+    const index_t* row = &data[(vertical ? height - 1 - y : y) * width];
+    for (unsigned x = 0; x < width; ++x)
+      h = fnv1a(&row[horizontal ? width - 1 - x : x], 1, h);
+  }
+  return h;
+}
 
-  if (!no_flip) {
-    _mirrors.push_back(mirror(_data, _width, true, false));
-    _mirrors.push_back(mirror(_data, _width, false, true));
-    _mirrors.push_back(mirror(_data, _width, true, true));
+rgba_vec_t make_grayscale_palette(unsigned bpp) {
+  rgba_vec_t palette(palette_size_at_bpp(bpp));
+  channel_t add = 0x100 / palette.size();
+  for (unsigned i = 0; i < palette.size(); ++i) {
+    channel_t value = add * i;
+    palette[i] = (rgba_t)(0xff000000 + value + (value << 8) + (value << 16));
   }
+  return palette;
+}
+
+// grayscale palette shared by all tiles of a bit depth
+std::shared_ptr<const rgba_vec_t> grayscale_palette(unsigned bpp) {
+  static const auto palettes = [] {
+    std::vector<std::shared_ptr<const rgba_vec_t>> v;
+    for (unsigned depth = 0; depth <= 8; ++depth)
+      v.push_back(std::make_shared<const rgba_vec_t>(make_grayscale_palette(depth)));
+    return v;
+  }();
+  return bpp < palettes.size() ? palettes[bpp] : std::make_shared<const rgba_vec_t>(make_grayscale_palette(bpp));
+}
+
+} // namespace
+
+Tile::Tile(const byte_vec_t& native_data, Mode mode, unsigned bpp, bool no_flip, unsigned width, unsigned height)
+    : _mode(mode), _bpp(bpp), _width(width), _height(height), _data(unpack_native_tile(native_data, mode, bpp, width, height)),
+      _flippable(!no_flip), _palette(grayscale_palette(bpp)) {
+  slice();
 }
 
 Tile::Tile(const std::vector<Tile>& metatile, bool no_flip, unsigned width, unsigned height) {
@@ -41,6 +121,7 @@ Tile::Tile(const std::vector<Tile>& metatile, bool no_flip, unsigned width, unsi
   _mode = metatile[0]._mode;
   _bpp = metatile[0]._bpp;
   _palette = metatile[0]._palette;
+  _flippable = !no_flip;
   _width = width;
   _height = height;
   _data.resize(width * height);
@@ -59,42 +140,97 @@ Tile::Tile(const std::vector<Tile>& metatile, bool no_flip, unsigned width, unsi
       ++metatile_index;
     }
   }
+  slice();
+}
 
-  if (!no_flip) {
-    _mirrors.push_back(mirror(_data, _width, true, false));
-    _mirrors.push_back(mirror(_data, _width, false, true));
-    _mirrors.push_back(mirror(_data, _width, true, true));
-  }
+const rgba_vec_t& Tile::palette() const {
+  static const rgba_vec_t empty;
+  return _palette ? *_palette : empty;
 }
 
 bool Tile::operator==(const Tile& other) const {
-  if (other._data == _data)
+  if (_sliced && other._sliced) {
+    if (_planes == other._planes)
+      return true;
+  } else if (other._data == _data) {
     return true;
-  if (!_mirrors.empty()) {
-    return std::any_of(_mirrors.begin(), _mirrors.end(), [&](const auto& m) { return m == other._data; });
   }
+  if (_flippable)
+    return equals_mirrored(other, true, false) || equals_mirrored(other, false, true) || equals_mirrored(other, true, true);
   return false;
 }
 
+uint64_t Tile::hash() const {
+  uint64_t h = orientation_hash(false, false);
+  if (!_flippable || _data.empty())
+    return h;
+  h = std::min(h, orientation_hash(true, false));
+  h = std::min(h, orientation_hash(false, true));
+  return std::min(h, orientation_hash(true, true));
+}
+
 TileFlipped Tile::is_flipped(const Tile& other) const {
   TileFlipped flipped;
-  if (other._data == _data)
+  if (_sliced && other._sliced ? _planes == other._planes : other._data == _data)
     return flipped;
 
-  if (_mirrors.empty())
+  if (!_flippable)
     throw std::runtime_error("Programmer error");
 
-  if (other._data == _mirrors[0]) {
+  if (equals_mirrored(other, true, false)) {
     flipped.h = true;
-  } else if (other._data == _mirrors[1]) {
+  } else if (equals_mirrored(other, false, true)) {
     flipped.v = true;
-  } else if (other._data == _mirrors[2]) {
+  } else if (equals_mirrored(other, true, true)) {
     flipped.h = flipped.v = true;
   }
 
   return flipped;
 }
 
+// set bit planes if tile is 8x8 and all pixels fit in bpp
+void Tile::slice() {
+  _sliced = false;
+  if (_width != 8 || _data.size() != 64 || _bpp == 0 || _bpp > 8)
+    return;
+  const index_t mask = bitmask_at_bpp(_bpp);
+  for (index_t ip : _data) {
+    if (ip & ~mask)
+      return;
+  }
+  _planes = slice_tile(_data.data(), _bpp);
+  _sliced = true;
+}
+
+// true if other equals tile data mirrored
+bool Tile::equals_mirrored(const Tile& other, bool horizontal, bool vertical) const {
+  if (_sliced && other._sliced) {
+    // pixels fit in both bpp settings, so planes above the larger one are zero in both tiles
+    const unsigned planes = std::max(_bpp, other._bpp);
+    for (unsigned p = 0; p < planes; ++p) {
+      uint64_t plane = _planes[p];
+      if (horizontal)
+        plane = flip_plane_h(plane);
+      if (vertical)
+        plane = flip_plane_v(plane);
+      if (plane != other._planes[p])
+        return false;
+    }
+    return true;
+  }
+
+  if (other._data.size() != _data.size() || _data.size() % _width != 0)
+    return false;
+  return mirrored_equal(_data.data(), other._data.data(), _width, (unsigned)_data.size() / _width, horizontal, vertical);
+}
+
+// hash of tile data in mirrored orientation
+uint64_t Tile::orientation_hash(bool horizontal, bool vertical) const {
+  if (_data.empty())
+    return fnv1a(nullptr, 0);
+  return sfc::orientation_hash(_data.data(), _width, (unsigned)_data.size() / _width, horizontal, vertical);
+}
+
 Tile Tile::crop(unsigned x, unsigned y, unsigned crop_width, unsigned crop_height) const {
   Tile t;
   t._mode = _mode;
@@ -102,6 +238,7 @@ Tile Tile::crop(unsigned x, unsigned y, unsigned crop_width, unsigned crop_heigh
   t._width = crop_width;
   t._height = crop_height;
   t._palette = _palette;
+  t._flippable = _flippable;
   t._data.resize(crop_width * crop_height);
 
   if (!(x > _width || y > _height)) {
@@ -111,12 +248,7 @@ Tile Tile::crop(unsigned x, unsigned y, unsigned crop_width, unsigned crop_heigh
       std::memcpy(&t._data[iy * t._width], &_data[(x) + ((iy + y) * _width)], blit_width);
     }
   }
-
-  if (_mirrors.size()) {
-    t._mirrors.push_back(mirror(t._data, t._width, true, false));
-    t._mirrors.push_back(mirror(t._data, t._width, false, true));
-    t._mirrors.push_back(mirror(t._data, t._width, true, true));
-  }
+  t.slice();
 
   return t;
 }
@@ -137,17 +269,20 @@ std::vector<Tile> Tile::crops(unsigned tile_width, unsigned tile_height) const {
 }
 
 byte_vec_t Tile::native_data() const {
+  if (_sliced && _height == 8 && planar_tiles_for_mode(_mode))
+    return pack_native_tile(_planes, _mode, _bpp);
   return pack_native_tile(_data, _mode, _bpp, _width, _height);
 }
 
 rgba_vec_t Tile::rgba_data() const {
   rgba_vec_t v(_data.size());
   for (unsigned i = 0; i < _data.size(); ++i)
-    v[i] = _palette[_data[i]];
+    v[i] = (*_palette)[_data[i]];
   return v;
 }
 
 Tileset::Tileset(const byte_vec_t& native_data, Mode mode, unsigned bpp, unsigned tile_width, unsigned tile_height, bool no_flip) {
+  SFC_TRACE_SPAN("load tiles");
   _mode = mode;
   _bpp = bpp;
   _tile_width = tile_width;
@@ -162,47 +297,420 @@ Tileset::Tileset(const byte_vec_t& native_data, Mode mode, unsigned bpp, unsigne
       throw std::runtime_error("Tile data can't be deserialized (size doesn't match bpp setting)");
     }
 
-    unsigned tiles = (unsigned)native_data.size() / bytes_per_tile;
-    for (unsigned i = 0; i < tiles; ++i) {
-      _tiles.push_back(
+    std::vector<Tile> tiles;
+    for (unsigned i = 0; i < native_data.size() / bytes_per_tile; ++i) {
+      tiles.push_back(
         Tile(byte_vec_t(&native_data[i * bytes_per_tile], &native_data[(i + 1) * bytes_per_tile]), mode, bpp, no_flip, 8, 8));
     }
 
     if (_tile_width != 8 || _tile_height != 8)
-      _tiles = remap_tiles_for_input(_tiles, _mode);
+      tiles = remap_tiles_for_input(tiles, _mode);
+
+    for (const auto& t : tiles)
+      append(t._data.data(), palette_id(t._palette));
   }
+
+  // identifies index data built for this exact input
+  const uint8_t settings[] = {(uint8_t)_mode, (uint8_t)_bpp, (uint8_t)_tile_width, (uint8_t)_tile_height};
+  _checksum = fnv1a(settings, sizeof(settings), fnv1a(native_data.data(), native_data.size()));
 }
 
 void Tileset::add(const Image& image, const Palette* palette) {
-  Tile tile;
+  insert(make_tile(image, palette));
+}
+
+// add images, remapping them in parallel and inserting in order
+// when adding in batches, rebuild_index can be left off for all but the last batch
+void Tileset::add(const std::vector<Image>& images, const Palette* palette, unsigned jobs, bool rebuild_index) {
+  std::vector<Tile> tiles(images.size());
+  std::vector<std::exception_ptr> errors(images.size());
+
+  parallel_for(images.size(), jobs, [&](size_t i) {
+    try {
+      tiles[i] = make_tile(images[i], palette);
+    } catch (...) {
+      errors[i] = std::current_exception();
+    }
+  });
+
+  // tiles preceding a failing image are kept, as when adding one by one
+  for (size_t i = 0; i < tiles.size(); ++i) {
+    if (errors[i])
+      std::rethrow_exception(errors[i]);
+    insert(tiles[i]);
+  }
+  if (rebuild_index)
+    build_index();
+}
+
+// add crops of grid as adding them one by one does, remapping each distinct crop once
+// crops repeating a crop added by an earlier call reuse its tile while grids share ids and the palette is unchanged
+// uniform crops are resolved by subpalette and color index, skipping remapping and dedupe after the first occurrence
+void Tileset::add(const TileGrid& grid, const Palette* palette, unsigned jobs, bool rebuild_index) {
+  const uint64_t palette_generation = palette ? palette->generation() : 0;
+  if (palette_generation != _crop_palette) {
+    _solid_tiles.clear();
+    _crop_tiles.clear();
+    _crop_palette = palette_generation;
+  }
+  if (grid.generation() != _crop_generation) {
+    _crop_tiles.clear();
+    _crop_generation = grid.generation();
+  }
+  if (_crop_tiles.size() < grid.id_count())
+    _crop_tiles.resize(grid.id_count(), -1);
+
+  // remapped pixel data and temporaries of this call, allocated up front so workers only write their own tiles
+  Arena arena;
+  pmr::index_vec_t data(grid.size() * pixel_count(), arena.resource());
+  std::pmr::vector<std::shared_ptr<const rgba_vec_t>> palettes(grid.size(), arena.resource());
+  std::pmr::vector<std::pair<int, index_t>> solid_keys(grid.size(), {-1, 0}, arena.resource());
+  std::pmr::vector<std::exception_ptr> errors(grid.size(), arena.resource());
+
+  parallel_for(grid.size(), jobs, [&](size_t i) {
+    const unsigned index = (unsigned)i;
+    if (grid.first_identical(index) != index || _crop_tiles[grid.id(index)] != -1)
+      return;
+    try {
+      if (palette && is_uniform(grid, index)) {
+        const Subpalette& sp = palette->subpalette_matching(grid, index);
+        solid_keys[i] = {palette->index_of(sp), sp.remap_reduced_index(grid.reduced_color_at(index, 0))};
+      } else {
+        palettes[i] = remap(grid, index, palette, &data[i * pixel_count()]);
+      }
+    } catch (...) {
+      errors[i] = std::current_exception();
+    }
+  });
+
+  // tiles preceding a failing crop are kept, as when adding one by one
+  for (unsigned i = 0; i < grid.size(); ++i) {
+    if (errors[i])
+      std::rethrow_exception(errors[i]);
+
+    int& crop_tile = _crop_tiles[grid.id(i)];
+    if (crop_tile != -1) {
+      // an equal tile was kept or discarded on first occurrence
+      if (_no_discard) {
+        const index_vec_t data(pixels(crop_tile), pixels(crop_tile) + pixel_count());
+        append(data.data(), _palette_ids[crop_tile]);
+      } else {
+        ++discarded_tiles;
+      }
+      continue;
+    }
+
+    if (solid_keys[i].first == -1) {
+      crop_tile = (int)insert(&data[i * pixel_count()], palettes[i]);
+      continue;
+    }
+    auto it = _solid_tiles.find(solid_keys[i]);
+    if (it == _solid_tiles.end()) {
+      const auto solid_palette = remap(grid, i, palette, &data[i * pixel_count()]);
+      it = _solid_tiles.emplace(solid_keys[i], insert(&data[i * pixel_count()], solid_palette)).first;
+    } else if (_no_discard) {
+      const index_vec_t data(pixels(it->second), pixels(it->second) + pixel_count());
+      append(data.data(), _palette_ids[it->second]);
+    } else {
+      ++discarded_tiles;
+    }
+    crop_tile = (int)it->second;
+  }
+  if (rebuild_index)
+    build_index();
+}
+
+bool Tileset::is_uniform(const TileGrid& grid, unsigned index) const {
+  return !_no_remap && grid.is_uniform(index) && grid.tile_width() == _tile_width && grid.tile_height() == _tile_height;
+}
+
+Tile Tileset::make_tile(const Image& image, const Palette* palette) const {
+  if (_no_remap)
+    return Tile(image, _mode, _bpp, _no_flip);
+
+  if (palette == nullptr)
+    throw std::runtime_error("Can't remap tile without palette");
+  const Subpalette& subpalette = palette->subpalette_matching(image);
+  return Tile(Image(image, subpalette, true), _mode, _bpp, _no_flip, subpalette.shared_normalized_colors());
+}
+
+// write tile_width * tile_height indices of tile at index of grid as make_tile() would produce them, returning its palette
+std::shared_ptr<const rgba_vec_t> Tileset::remap(const TileGrid& grid, unsigned index, const Palette* palette,
+                                                 index_t* data) const {
+  if (grid.tile_width() != _tile_width || grid.tile_height() != _tile_height)
+    throw std::runtime_error("programmer error (tile size doesn't match tileset)");
 
+  const index_t mask = bitmask_at_bpp(_bpp);
   if (_no_remap) {
-    tile = Tile(image, _mode, _bpp, _no_flip);
-  } else {
-    if (palette == nullptr)
-      throw std::runtime_error("Can't remap tile without palette");
-    Image remapped_image = Image(image, palette->subpalette_matching(image));
-    tile = Tile(remapped_image, _mode, _bpp, _no_flip);
+    const auto indexed = grid.indexed_data(index);
+    if (indexed.empty())
+      throw std::runtime_error("Can't create tile without indexed data");
+    for (size_t p = 0; p < indexed.size(); ++p)
+      data[p] = indexed[p] & mask;
+    return grid.palette();
   }
 
+  if (palette == nullptr)
+    throw std::runtime_error("Can't remap tile without palette");
+  const Subpalette& subpalette = palette->subpalette_matching(grid, index);
+  grid.remap(index, subpalette, data);
+  for (size_t p = 0; p < pixel_count(); ++p)
+    data[p] &= mask;
+  return subpalette.shared_normalized_colors();
+}
+
+unsigned Tileset::insert(const Tile& tile) {
+  if (tile._width != _tile_width || tile._data.size() != pixel_count())
+    throw std::runtime_error("programmer error (tile size doesn't match tileset)");
+  return insert(tile._data.data(), tile._palette);
+}
+
+// add tile unless an equal tile is kept (or no_discard is set), returning the index of the new or equal tile
+unsigned Tileset::insert(const index_t* data, const std::shared_ptr<const rgba_vec_t>& palette) {
   if (_no_discard) {
-    _tiles.push_back(tile);
-  } else {
-    if (std::find(_tiles.begin(), _tiles.end(), tile) == _tiles.end()) {
-      _tiles.push_back(tile);
-    } else {
+    append(data, palette_id(palette));
+    return size() - 1;
+  }
+
+  // index tiles added by other means
+  for (; _indexed_tiles < size(); ++_indexed_tiles)
+    _index.emplace(pixels_hash(pixels(_indexed_tiles)), _indexed_tiles);
+
+  const uint64_t hash = pixels_hash(data);
+  auto range = _index.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (pixels_match(it->second, data, nullptr)) {
       ++discarded_tiles;
+      return it->second;
     }
   }
+
+  _index.emplace(hash, size());
+  append(data, palette_id(palette));
+  ++_indexed_tiles;
+  return size() - 1;
 }
 
-int Tileset::index_of(const Tile& tile) const {
-  const auto index = std::find(_tiles.begin(), _tiles.end(), tile);
-  if (index != _tiles.end()) {
-    return (int)std::distance(_tiles.begin(), index);
+// append tile data to the pixel arena
+void Tileset::append(const index_t* data, unsigned palette_id) {
+  if (_tile_width == 8 && _tile_height == 8) {
+    std::memcpy(_pixels_8x8.emplace_back().data(), data, pixel_count());
+  } else if (_tile_width == 16 && _tile_height == 16) {
+    std::memcpy(_pixels_16x16.emplace_back().data(), data, pixel_count());
   } else {
+    if (_pixel_stride == 0)
+      _pixel_stride = (unsigned)(pixel_count() + 63) & ~63u;
+    _pixels.resize(_pixels.size() + _pixel_stride);
+    std::memcpy(&_pixels[_pixels.size() - _pixel_stride], data, pixel_count());
+  }
+  _palette_ids.push_back(palette_id);
+  _generation = unique_serial();
+}
+
+const index_t* Tileset::pixels(unsigned index) const {
+  if (_tile_width == 8 && _tile_height == 8)
+    return _pixels_8x8[index].data();
+  if (_tile_width == 16 && _tile_height == 16)
+    return _pixels_16x16[index].data();
+  return &_pixels[(size_t)index * _pixel_stride];
+}
+
+// id of an earlier tile's palette if colors are equal, so kept tiles share few palette copies
+unsigned Tileset::palette_id(const std::shared_ptr<const rgba_vec_t>& palette) {
+  // tiles remapped to the same subpalette already share a handle
+  for (unsigned i = 0; i < _palettes.size(); ++i) {
+    if (_palettes[i] == palette)
+      return i;
+  }
+  for (unsigned i = 0; palette && i < _palettes.size(); ++i) {
+    if (_palettes[i] && *_palettes[i] == *palette)
+      return i;
+  }
+  _palettes.push_back(palette);
+  return (unsigned)_palettes.size() - 1;
+}
+
+Tile Tileset::tile(unsigned index) const {
+  return Tile(std::span<const index_t>(pixels(index), pixel_count()), _mode, _bpp, _no_flip, _tile_width, _tile_height,
+              _palettes[_palette_ids[index]]);
+}
+
+std::vector<Tile> Tileset::tiles() const {
+  std::vector<Tile> tv;
+  tv.reserve(size());
+  for (unsigned i = 0; i < size(); ++i)
+    tv.push_back(tile(i));
+  return tv;
+}
+
+// true if tile at index equals data, in any orientation unless no_flip, giving the orientation in flipped if given
+bool Tileset::pixels_match(unsigned index, const index_t* data, TileFlipped* flipped) const {
+  const index_t* tile_data = pixels(index);
+  if (pixels_equal(tile_data, data, pixel_count())) {
+    if (flipped)
+      *flipped = {};
+    return true;
+  }
+  if (_no_flip)
+    return false;
+
+  TileFlipped orientation;
+  bool match;
+  if (_tile_width == 8 && _tile_height == 8)
+    match = mirrored_match<8, 8>(tile_data, data, 8, 8, orientation);
+  else if (_tile_width == 16 && _tile_height == 16)
+    match = mirrored_match<16, 16>(tile_data, data, 16, 16, orientation);
+  else
+    match = mirrored_match<0, 0>(tile_data, data, _tile_width, _tile_height, orientation);
+  if (match && flipped)
+    *flipped = orientation;
+  return match;
+}
+
+// dedupe hash of tile data, equal for data comparing equal (including mirrored data unless no_flip)
+uint64_t Tileset::pixels_hash(const index_t* data) const {
+  uint64_t h = orientation_hash(data, _tile_width, _tile_height, false, false);
+  if (_no_flip)
+    return h;
+  h = std::min(h, orientation_hash(data, _tile_width, _tile_height, true, false));
+  h = std::min(h, orientation_hash(data, _tile_width, _tile_height, false, true));
+  return std::min(h, orientation_hash(data, _tile_width, _tile_height, true, true));
+}
+
+int Tileset::index_of(const Tile& tile, TileFlipped* flipped) const {
+  if (tile._width != _tile_width || tile._data.size() != pixel_count())
     return -1;
+  return index_of(tile._data.data(), flipped);
+}
+
+int Tileset::index_of(const index_t* data, TileFlipped* flipped) const {
+  if (_lookup_tiles != size() || size() == 0) {
+    for (unsigned i = 0; i < size(); ++i) {
+      if (pixels_match(i, data, flipped))
+        return (int)i;
+    }
+    return -1;
+  }
+
+  // a tile compares equal to any orientation of an indexed tile, candidates are in ascending tile order
+  const uint64_t hash = fnv1a(data, pixel_count());
+  auto it = std::lower_bound(_lookup.begin(), _lookup.end(), std::make_pair(hash, 0u));
+  for (; it != _lookup.end() && it->first == hash; ++it) {
+    if (pixels_match(it->second, data, flipped))
+      return (int)it->second;
+  }
+  return -1;
+}
+
+// index all orientations of every tile
+// mirrored orientations are included regardless of no_flip, so index data doesn't depend on that setting
+void Tileset::build_index() {
+  SFC_TRACE_SPAN("build tile index");
+  _lookup.clear();
+  for (unsigned i = 0; i < size(); ++i) {
+    const index_t* data = pixels(i);
+    _lookup.emplace_back(orientation_hash(data, _tile_width, _tile_height, false, false), i);
+    _lookup.emplace_back(orientation_hash(data, _tile_width, _tile_height, true, false), i);
+    _lookup.emplace_back(orientation_hash(data, _tile_width, _tile_height, false, true), i);
+    _lookup.emplace_back(orientation_hash(data, _tile_width, _tile_height, true, true), i);
+  }
+  std::sort(_lookup.begin(), _lookup.end());
+  _lookup.erase(std::unique(_lookup.begin(), _lookup.end()), _lookup.end());
+  _lookup_tiles = size();
+  build_uniform_lookup();
+  _generation = unique_serial();
+}
+
+// uniform tiles equal only each other in any orientation, so the first one per index value is what index_of() finds
+void Tileset::build_uniform_lookup() {
+  _uniform_lookup.fill(-1);
+  for (unsigned i = 0; i < size(); ++i) {
+    const index_t* data = pixels(i);
+    if (_uniform_lookup[data[0]] != -1)
+      continue;
+    if (std::adjacent_find(data, data + pixel_count(), std::not_equal_to<index_t>()) == data + pixel_count())
+      _uniform_lookup[data[0]] = (int)i;
+  }
+}
+
+//
+// index data layout (little endian)
+//   "sfci"
+//   u32 version
+//   u64 checksum of the native tile data, mode, bpp and tile size the tileset was loaded with
+//   u32 tile count
+//   u32 entry count
+//   entries: u64 hash, u32 tile index
+//
+
+namespace {
+
+const char index_magic[] = {'s', 'f', 'c', 'i'};
+const unsigned index_version = 1;
+const size_t index_header_size = 24;
+const size_t index_entry_size = 12;
+
+void put_le(byte_vec_t& data, uint64_t value, unsigned bytes) {
+  for (unsigned i = 0; i < bytes; ++i)
+    data.push_back((value >> (i * 8)) & 0xff);
+}
+
+uint64_t get_le(const byte_vec_t& data, size_t offset, unsigned bytes) {
+  uint64_t value = 0;
+  for (unsigned i = 0; i < bytes; ++i)
+    value |= (uint64_t)data[offset + i] << (i * 8);
+  return value;
+}
+
+} // namespace
+
+// load index data, returning false if it doesn't match the loaded tileset
+bool Tileset::load_index(const byte_vec_t& index_data) {
+  SFC_TRACE_SPAN("load tile index");
+  if (index_data.size() < index_header_size || !std::equal(index_magic, index_magic + 4, index_data.begin()))
+    return false;
+  if (get_le(index_data, 4, 4) != index_version || get_le(index_data, 8, 8) != _checksum || _checksum == 0)
+    return false;
+  if (get_le(index_data, 16, 4) != size())
+    return false;
+
+  const size_t entries = get_le(index_data, 20, 4);
+  if (index_data.size() != index_header_size + entries * index_entry_size)
+    return false;
+
+  std::vector<std::pair<uint64_t, unsigned>> lookup(entries);
+  for (size_t i = 0; i < entries; ++i) {
+    const size_t offset = index_header_size + i * index_entry_size;
+    lookup[i] = {get_le(index_data, offset, 8), (unsigned)get_le(index_data, offset + 8, 4)};
+    if (lookup[i].second >= size() || (i > 0 && lookup[i] <= lookup[i - 1]))
+      return false;
   }
+
+  _lookup = std::move(lookup);
+  _lookup_tiles = size();
+  build_uniform_lookup();
+  _generation = unique_serial();
+  return true;
+}
+
+byte_vec_t Tileset::index_data() const {
+  if (_lookup_tiles != size())
+    throw std::runtime_error("programmer error (tileset index not built)");
+
+  byte_vec_t data(index_magic, index_magic + 4);
+  put_le(data, index_version, 4);
+  put_le(data, _checksum, 8);
+  put_le(data, size(), 4);
+  put_le(data, _lookup.size(), 4);
+  for (const auto& e : _lookup) {
+    put_le(data, e.first, 8);
+    put_le(data, e.second, 4);
+  }
+  return data;
+}
+
+void Tileset::save_index(const std::string& path) const {
+  write_file(path, index_data());
 }
 
 void Tileset::save(const std::string& path) const {
@@ -210,19 +718,30 @@ void Tileset::save(const std::string& path) const {
 }
 
 byte_vec_t Tileset::native_data() const {
-  std::vector<Tile> tv;
-  if (_mode != Mode::pce_sprite && (_tile_width != 8 || _tile_height != 8)) {
-    tv = remap_tiles_for_output(_tiles, _mode);
-  } else {
-    tv = _tiles;
+  if (!encodes_by_tile()) {
+    byte_vec_t data;
+    for (const auto& t : remap_tiles_for_output(tiles(), _mode)) {
+      auto nt = t.native_data();
+      data.insert(data.end(), nt.begin(), nt.end());
+    }
+    return data;
   }
 
+  return native_data(0, size());
+}
+
+byte_vec_t Tileset::native_data(unsigned first, unsigned count) const {
+  if (!encodes_by_tile())
+    throw std::runtime_error("programmer error (tileset doesn't encode by tile)");
+
+  // encode straight from the pixel arena
   byte_vec_t data;
-  for (const auto& t : tv) {
-    auto nt = t.native_data();
+  index_vec_t tile_data(pixel_count());
+  for (unsigned i = first; i < first + count; ++i) {
+    std::memcpy(tile_data.data(), pixels(i), tile_data.size());
+    const auto nt = pack_native_tile(tile_data, _mode, _bpp, _tile_width, _tile_height);
     data.insert(data.end(), nt.begin(), nt.end());
   }
-
   return data;
 }
 
@@ -263,7 +782,7 @@ std::vector<Tile> Tileset::remap_tiles_for_input(const std::vector<Tile>& tiles,
     const unsigned cells_per_tile_h = _tile_width / 8;
     const unsigned cells_per_tile_v = _tile_height / 8;
 
-    for (unsigned i = 0; i < _tiles.size(); ++i) {
+    for (unsigned i = 0; i < tiles.size(); ++i) {
       std::vector<Tile> metatile;
       for (unsigned yo = 0; yo < cells_per_tile_v; ++yo) {
         for (unsigned xo = 0; xo < cells_per_tile_h; ++xo) {
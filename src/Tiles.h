@@ -4,6 +4,12 @@
 
 #pragma once
 
+#include <array>
+#include <map>
+#include <memory>
+#include <span>
+#include <unordered_map>
+
 #include "Common.h"
 #include "Image.h"
 #include "Palette.h"
@@ -12,14 +18,25 @@ namespace sfc {
 
 struct Image;
 struct Palette;
+struct TileGrid;
 
 struct TileFlipped {
   bool h = false;
   bool v = false;
 };
 
+// pixel data of the common tile sizes, in row order
+typedef std::array<index_t, 64> tile_8x8_t;
+typedef std::array<index_t, 256> tile_16x16_t;
+
 struct Tile {
-  Tile(const Image& image, Mode mode = Mode::snes, unsigned bpp = 4, bool no_flip = false);
+  // palette is shared with the tile if given, otherwise the tile gets a copy of the image palette
+  Tile(const Image& image, Mode mode = Mode::snes, unsigned bpp = 4, bool no_flip = false,
+       std::shared_ptr<const rgba_vec_t> palette = nullptr);
+
+  // tile of width * height indices in row order, sharing palette
+  Tile(std::span<const index_t> data, Mode mode, unsigned bpp, bool no_flip, unsigned width, unsigned height,
+       std::shared_ptr<const rgba_vec_t> palette);
 
   Tile(const byte_vec_t& native_data, Mode mode = Mode::snes, unsigned bpp = 4, bool no_flip = false, unsigned width = 8,
        unsigned height = 8);
@@ -28,18 +45,24 @@ struct Tile {
 
   Tile(Mode mode, unsigned bpp, unsigned width, unsigned height) : _mode(mode), _bpp(bpp), _width(width), _height(height) {
     _data.resize(width * height);
-    _palette.resize(palette_size_at_bpp(bpp));
+    _palette = std::make_shared<const rgba_vec_t>(palette_size_at_bpp(bpp));
+    slice();
   };
 
   Tile(){};
 
+  unsigned width() const { return _width; }
+  unsigned height() const { return _height; }
   const index_vec_t& data() const { return _data; }
-  const rgba_vec_t& palette() const { return _palette; }
+  const rgba_vec_t& palette() const;
   byte_vec_t native_data() const;
   rgba_vec_t rgba_data() const;
 
   bool operator==(const Tile& other) const;
 
+  // hash of tile data, equal for tiles comparing equal (including mirrored tiles unless no_flip)
+  uint64_t hash() const;
+
   TileFlipped is_flipped(const Tile& other) const;
 
   Tile crop(unsigned x, unsigned y, unsigned width, unsigned height) const;
@@ -51,8 +74,22 @@ private:
   unsigned _width = 8;
   unsigned _height = 8;
   index_vec_t _data;
-  std::vector<index_vec_t> _mirrors;
-  rgba_vec_t _palette;
+
+  // mirrored orientations compare equal, computed on demand
+  bool _flippable = false;
+
+  // bit planes of 8x8 tiles with all pixels fitting in bpp, used for compares and planar output
+  tile_planes_t _planes = {};
+  bool _sliced = false;
+
+  // palette shared between tiles, only used for rgba output
+  std::shared_ptr<const rgba_vec_t> _palette;
+
+  void slice();
+  bool equals_mirrored(const Tile& other, bool horizontal, bool vertical) const;
+  uint64_t orientation_hash(bool horizontal, bool vertical) const;
+
+  friend struct Tileset;
 };
 
 struct Tileset {
@@ -66,18 +103,47 @@ struct Tileset {
 
   unsigned tile_width() const { return _tile_width; }
   unsigned tile_height() const { return _tile_height; }
-  unsigned size() const { return (unsigned)_tiles.size(); }
+  unsigned size() const { return (unsigned)_palette_ids.size(); }
   unsigned max() const { return _max_tiles; }
-  bool is_full() const { return _max_tiles > 0 && _tiles.size() > _max_tiles; }
+  bool is_full() const { return _max_tiles > 0 && size() > _max_tiles; }
+
+  // tiles built from the pixel arena on request
+  Tile tile(unsigned index) const;
+  std::vector<Tile> tiles() const;
+
+  // index of first tile equal to tile (in any orientation unless no_flip), with the orientation of the found tile that
+  // gives tile in flipped if given, or -1 if there is none
+  int index_of(const Tile& tile, TileFlipped* flipped = nullptr) const;
+  // same for tile_width * tile_height indices in row order
+  int index_of(const index_t* data, TileFlipped* flipped = nullptr) const;
 
-  const std::vector<Tile>& tiles() const { return _tiles; }
+  // same as index_of() for a tile with all pixels set to value, usable once the lookup index is built
+  bool has_uniform_lookup() const { return _lookup_tiles == size(); }
+  int index_of_uniform(index_t value) const { return size() == 0 ? -1 : _uniform_lookup[value]; }
 
-  int index_of(const Tile& tile) const;
+  // true if tile of grid remaps to a tile of this tileset with all pixels set to one index
+  bool is_uniform(const TileGrid& grid, unsigned index) const;
   void add(const Image& image, const Palette* palette = nullptr);
+  void add(const std::vector<Image>& images, const Palette* palette = nullptr, unsigned jobs = 1, bool rebuild_index = true);
+  void add(const TileGrid& grid, const Palette* palette = nullptr, unsigned jobs = 1, bool rebuild_index = true);
+
+  // changes whenever tiles or the lookup index change
+  uint64_t generation() const { return _generation; }
+
+  // lookup index used by index_of(), stale after adding tiles until rebuilt
+  void build_index();
+  bool load_index(const byte_vec_t& index_data);
+  byte_vec_t index_data() const;
+  void save_index(const std::string& path) const;
 
   byte_vec_t native_data() const;
   void save(const std::string& path) const;
 
+  // true if native data is the tiles encoded one by one in order (no metatile rearrangement), so that
+  // native_data(first, count) of consecutive ranges concatenate to native_data()
+  bool encodes_by_tile() const { return _mode == Mode::pce_sprite || (_tile_width == 8 && _tile_height == 8); }
+  byte_vec_t native_data(unsigned first, unsigned count) const;
+
   unsigned discarded_tiles = 0;
 
 private:
@@ -90,7 +156,53 @@ private:
   bool _no_remap = false;
   unsigned _max_tiles = 0;
 
-  std::vector<Tile> _tiles;
+  // pixel arena holding the only copy of tile data, as a structure of arrays indexed by tile
+  // 8x8 and 16x16 tiles are kept in columns of fixed size arrays, other sizes at a cache line aligned stride
+  std::vector<tile_8x8_t, aligned_allocator<tile_8x8_t, 64>> _pixels_8x8;
+  std::vector<tile_16x16_t, aligned_allocator<tile_16x16_t, 64>> _pixels_16x16;
+  std::vector<index_t, aligned_allocator<index_t, 64>> _pixels;
+  unsigned _pixel_stride = 0;
+
+  // palette of each tile, as an index in _palettes (tiles share few palette copies)
+  std::vector<unsigned> _palette_ids;
+  std::vector<std::shared_ptr<const rgba_vec_t>> _palettes;
+
+  // dedupe index, tile hash -> tile indices
+  std::unordered_multimap<uint64_t, unsigned> _index;
+  unsigned _indexed_tiles = 0;
+
+  // lookup index, (orientation hash, tile index) pairs in ascending order
+  std::vector<std::pair<uint64_t, unsigned>> _lookup;
+  unsigned _lookup_tiles = 0;
+  uint64_t _checksum = 0;
+
+  // first tile with all pixels set to each index value, -1 if none, rebuilt with the lookup index
+  std::array<int, 256> _uniform_lookup;
+
+  uint64_t _generation = unique_serial();
+
+  // results of add(grid), valid for grids of generation _crop_generation remapped with palette generation _crop_palette
+  uint64_t _crop_generation = 0;
+  uint64_t _crop_palette = 0;
+
+  // by grid crop id, index of the tile each distinct crop was inserted as or found equal to, -1 if not added
+  std::vector<int> _crop_tiles;
+
+  // index of the tile remapped from uniform crops, by subpalette index and color index
+  std::map<std::pair<int, index_t>, unsigned> _solid_tiles;
+
+  size_t pixel_count() const { return (size_t)_tile_width * _tile_height; }
+  const index_t* pixels(unsigned index) const;
+  bool pixels_match(unsigned index, const index_t* data, TileFlipped* flipped) const;
+  uint64_t pixels_hash(const index_t* data) const;
+
+  Tile make_tile(const Image& image, const Palette* palette) const;
+  std::shared_ptr<const rgba_vec_t> remap(const TileGrid& grid, unsigned index, const Palette* palette, index_t* data) const;
+  void build_uniform_lookup();
+  unsigned insert(const Tile& tile);
+  unsigned insert(const index_t* data, const std::shared_ptr<const rgba_vec_t>& palette);
+  void append(const index_t* data, unsigned palette_id);
+  unsigned palette_id(const std::shared_ptr<const rgba_vec_t>& palette);
 
   std::vector<Tile> remap_tiles_for_output(const std::vector<Tile>& tiles, Mode mode) const;
   std::vector<Tile> remap_tiles_for_input(const std::vector<Tile>& tiles, Mode mode) const;
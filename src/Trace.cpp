@@ -0,0 +1,105 @@
+#include "Trace.h"
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "Common.h"
+
+namespace sfc::trace {
+
+std::atomic<bool> is_enabled = false;
+
+namespace {
+
+struct Event final {
+  const char* name;
+  std::string detail;
+  double ts;
+  double dur;
+  unsigned tid;
+};
+
+std::mutex events_mutex;
+std::vector<Event> events;
+std::map<unsigned, std::string> thread_names;
+std::chrono::steady_clock::time_point epoch;
+std::atomic<unsigned> next_tid = 1;
+
+thread_local unsigned current_tid = 0;
+
+unsigned thread_id() {
+  if (current_tid == 0)
+    current_tid = next_tid++;
+  return current_tid;
+}
+
+double micros_since_epoch(std::chrono::steady_clock::time_point tp) {
+  return std::chrono::duration<double, std::micro>(tp - epoch).count();
+}
+
+} // namespace
+
+Span::~Span() {
+  if (!enabled() || _start == std::chrono::steady_clock::time_point())
+    return;
+  const auto end = std::chrono::steady_clock::now();
+  const unsigned tid = thread_id();
+  std::lock_guard<std::mutex> lock(events_mutex);
+  events.push_back({_name, std::move(_detail), micros_since_epoch(_start), micros_since_epoch(end) - micros_since_epoch(_start), tid});
+}
+
+// threads taking the name of an earlier thread continue on its track, so short lived workers don't each add one
+void set_thread_name(const std::string& name) {
+  if (!enabled())
+    return;
+  std::lock_guard<std::mutex> lock(events_mutex);
+  for (const auto& tn : thread_names) {
+    if (tn.second == name) {
+      current_tid = tn.first;
+      return;
+    }
+  }
+  thread_names[thread_id()] = name;
+}
+
+void Session::start(const std::string& path) {
+  if (path.empty())
+    return;
+  _path = path;
+  {
+    std::lock_guard<std::mutex> lock(events_mutex);
+    events.clear();
+    thread_names.clear();
+    epoch = std::chrono::steady_clock::now();
+  }
+  is_enabled = true;
+  set_thread_name("main");
+}
+
+Session::~Session() {
+  if (_path.empty())
+    return;
+  is_enabled = false;
+
+  std::lock_guard<std::mutex> lock(events_mutex);
+  nlohmann::json te = nlohmann::json::array();
+
+  for (const auto& tn : thread_names)
+    te.push_back({{"name", "thread_name"}, {"ph", "M"}, {"pid", 1}, {"tid", tn.first}, {"args", {{"name", tn.second}}}});
+
+  for (const auto& e : events) {
+    nlohmann::json je = {{"name", e.name}, {"cat", "sfc"}, {"ph", "X"}, {"ts", e.ts}, {"dur", e.dur}, {"pid", 1}, {"tid", e.tid}};
+    if (!e.detail.empty())
+      je["args"] = {{"detail", e.detail}};
+    te.push_back(je);
+  }
+
+  try {
+    write_file(_path, nlohmann::json({{"traceEvents", te}, {"displayTimeUnit", "ms"}}).dump());
+  } catch (const std::exception& e) {
+    fmt::print(stderr, "Error: {}\n", e.what());
+  }
+}
+
+} /* namespace sfc::trace */
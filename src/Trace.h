@@ -0,0 +1,65 @@
+// trace event collection (chrome/perfetto json)
+//
+// david lindecrantz <optiroc@me.com>
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+namespace sfc::trace {
+
+extern std::atomic<bool> is_enabled;
+
+inline bool enabled() {
+  return is_enabled.load(std::memory_order_relaxed);
+}
+
+// scoped span, recorded as a complete event when tracing is enabled
+struct Span final {
+  Span(const char* name) : _name(name) {
+    if (enabled())
+      _start = std::chrono::steady_clock::now();
+  }
+
+  Span(const char* name, const std::string& detail) : _name(name) {
+    if (enabled()) {
+      _detail = detail;
+      _start = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~Span();
+
+  Span(const Span&) = delete;
+  Span& operator=(const Span&) = delete;
+
+private:
+  const char* _name;
+  std::string _detail;
+  std::chrono::steady_clock::time_point _start;
+};
+
+// name the calling thread in trace output, threads of the same name share a track
+void set_thread_name(const std::string& name);
+
+// collects events for the lifetime of a command invocation, writes them to path on destruction
+struct Session final {
+  Session(){};
+  ~Session();
+
+  void start(const std::string& path);
+
+  Session(const Session&) = delete;
+  Session& operator=(const Session&) = delete;
+
+private:
+  std::string _path;
+};
+
+} /* namespace sfc::trace */
+
+#define SFC_TRACE_CONCAT_(a, b) a##b
+#define SFC_TRACE_CONCAT(a, b) SFC_TRACE_CONCAT_(a, b)
+#define SFC_TRACE_SPAN(...) sfc::trace::Span SFC_TRACE_CONCAT(sfc_trace_span_, __LINE__)(__VA_ARGS__)
@@ -5,16 +5,21 @@
 
 #include <Options.h>
 #include "Common.h"
+#include "CropIndex.h"
 #include "Image.h"
 #include "Map.h"
+#include "Output.h"
 #include "Palette.h"
+#include "Parallel.h"
 #include "Tiles.h"
+#include "Trace.h"
 
 namespace SfcMap {
 struct Settings {
   std::string in_image;
   std::string in_palette;
   std::string in_tileset;
+  std::string in_index;
   std::string out_data;
   std::string out_json;
   std::string out_m7_data;
@@ -33,12 +38,15 @@ struct Settings {
   unsigned map_split_w;
   unsigned map_split_h;
   bool column_order;
+  unsigned jobs;
 };
 }; // namespace SfcMap
 
 int sfc_map(int argc, char* argv[]) {
   SfcMap::Settings settings = {};
   bool verbose = false;
+  std::string trace_path;
+  sfc::trace::Session trace_session;
 
   try {
     bool help = false;
@@ -50,8 +58,9 @@ int sfc_map(int argc, char* argv[]) {
 
     // clang-format off
     options.Add(settings.in_image,            'i', "in-image",            "Input: image");
-    options.Add(settings.in_palette,          'p', "in-palette",          "Input: palette (json/native)");
+    options.Add(settings.in_palette,          'p', "in-palette",          "Input: palette (json/native/act/gpl/jasc)");
     options.Add(settings.in_tileset,          't', "in-tiles",            "Input: tiles (native)");
+    options.Add(settings.in_index,           '\0', "in-index",            "Input: tile lookup index (from tiles)");
     options.Add(settings.out_data,            'd', "out-data",            "Output: native data");
     options.Add(settings.out_json,            'j', "out-json",            "Output: json");
     options.Add(settings.out_m7_data,         '7', "out-m7-data",         "Output: interleaved map/tile data (snes_mode7)");
@@ -70,8 +79,10 @@ int sfc_map(int argc, char* argv[]) {
     options.Add(settings.map_split_w,        '\0', "split-width",         "Split output into columns of <tiles> width", unsigned(0),          "Settings");
     options.Add(settings.map_split_h,        '\0', "split-height",        "Split output into rows of <tiles> height",   unsigned(0),          "Settings");
     options.AddSwitch(settings.column_order, '\0', "column-order",        "Output data in column-major order",          false,                "Settings");
+    options.Add(settings.jobs,               '\0', "jobs",                "Worker threads (0: one per core)",           unsigned(0),          "Settings");
 
     options.AddSwitch(verbose,                'v', "verbose",             "Verbose logging", false, "_");
+    options.Add(trace_path,                  '\0', "trace",               "Write trace events to json file", std::string(), "_");
     options.AddSwitch(help,                   'h', "help",                "Show this help",  false, "_");
     // clang-format on
 
@@ -95,12 +106,21 @@ int sfc_map(int argc, char* argv[]) {
     if (!sfc::bpp_allowed_for_mode(settings.bpp, settings.mode))
       throw std::runtime_error("bpp setting not compatible with specified mode");
 
+    if (settings.tile_base_offset < -(int)sfc::Map::max_tile_index || settings.tile_base_offset > (int)sfc::Map::max_tile_index)
+      throw std::runtime_error(fmt::format("tile-base-offset must be between -{0} and {0}", sfc::Map::max_tile_index));
+    if (settings.palette_base_offset < -(int)sfc::Map::max_palette_index ||
+        settings.palette_base_offset > (int)sfc::Map::max_palette_index)
+      throw std::runtime_error(fmt::format("palette-base-offset must be between -{0} and {0}", sfc::Map::max_palette_index));
+
+    trace_session.start(trace_path);
+
   } catch (const std::exception& e) {
     fmt::print(stderr, "Error: {}\n", e.what());
     return 1;
   }
 
   try {
+    SFC_TRACE_SPAN("sfc_map", settings.in_image);
     if (settings.in_image.empty())
       throw std::runtime_error("input image required");
     if (settings.in_palette.empty())
@@ -140,13 +160,37 @@ int sfc_map(int argc, char* argv[]) {
     if (verbose)
       fmt::print("Loaded tiles from \"{}\" ({} entries)\n", settings.in_tileset, tileset.size());
 
-    std::vector<sfc::Image> crops = image.crops(settings.tile_w, settings.tile_h, settings.mode);
+    if (!settings.in_index.empty() && tileset.load_index(sfc::read_binary(settings.in_index))) {
+      if (verbose)
+        fmt::print("Loaded tile lookup index from \"{}\"\n", settings.in_index);
+    } else {
+      if (!settings.in_index.empty())
+        fmt::print(stderr, "Tile lookup index \"{}\" doesn't match tiles, rebuilding\n", settings.in_index);
+      tileset.build_index();
+    }
+
+    const unsigned columns = sfc::div_ceil(image.width(), settings.tile_w);
+    const unsigned rows = sfc::div_ceil(image.height(), settings.tile_h);
     if (verbose)
-      fmt::print("Mapping {} {}x{}px tiles from image\n", crops.size(), settings.tile_w, settings.tile_h);
+      fmt::print("Mapping {} {}x{}px tiles from image\n", columns * rows, settings.tile_w, settings.tile_h);
 
     sfc::Map map(settings.mode, settings.map_w, settings.map_h, settings.tile_w, settings.tile_h);
-    for (unsigned i = 0; i < crops.size(); ++i) {
-      map.add(crops[i], tileset, palette, settings.bpp, i % settings.map_w, i / settings.map_w);
+    {
+      SFC_TRACE_SPAN("map");
+      // slice the image in bands of tiles while the previous band is matched to map entries
+      // bands share crop ids, so tiles repeating a tile of an earlier band are not matched again
+      const unsigned band_rows = sfc::pipeline_band_rows(columns);
+      sfc::CropIndex crops;
+      sfc::pipeline(
+        sfc::div_ceil(rows, band_rows), sfc::Constants::pipeline_depth, settings.jobs,
+        [&](size_t band) {
+          SFC_TRACE_SPAN("slice band");
+          return sfc::TileGrid(image, settings.tile_w, settings.tile_h, settings.mode, (unsigned)band * band_rows, band_rows,
+                               crops);
+        },
+        [&](size_t band, sfc::TileGrid grid) {
+          map.add(grid, tileset, palette, settings.bpp, settings.jobs, (unsigned)band * band_rows * columns);
+        });
     }
 
     if (settings.tile_base_offset)
@@ -159,36 +203,38 @@ int sfc_map(int argc, char* argv[]) {
     if (verbose && settings.column_order)
       fmt::print("Using column-major order for output\n");
 
+    sfc::OutputQueue outputs;
+
     if (!settings.out_data.empty()) {
-      map.save(settings.out_data, settings.column_order, settings.map_split_w, settings.map_split_h);
-      if (verbose)
-        fmt::print("Saved native map data to \"{}\"\n", settings.out_data);
+      outputs.add("write map", "native map data", settings.out_data, [&](const std::string& path) {
+        map.save(path, settings.column_order, settings.map_split_w, settings.map_split_h);
+      });
     }
 
     if (!settings.out_pal_map.empty()) {
-      map.save_pal_map(settings.out_pal_map, settings.column_order, settings.map_split_w, settings.map_split_h);
-      if (verbose)
-        fmt::print("Saved palette map to \"{}\"\n", settings.out_pal_map);
+      outputs.add("write palette map", "palette map", settings.out_pal_map, [&](const std::string& path) {
+        map.save_pal_map(path, settings.column_order, settings.map_split_w, settings.map_split_h);
+      });
     }
 
     if (!settings.out_json.empty()) {
-      sfc::write_file(settings.out_json, map.to_json(settings.column_order, settings.map_split_w, settings.map_split_h));
-      if (verbose)
-        fmt::print("Saved JSON map data to \"{}\"\n", settings.out_json);
+      outputs.add("write json", "JSON map data", settings.out_json, [&](const std::string& path) {
+        map.save_json(path, settings.column_order, settings.map_split_w, settings.map_split_h);
+      });
     }
 
     if (settings.mode == sfc::Mode::snes_mode7 && !settings.out_m7_data.empty()) {
-      sfc::write_file(settings.out_m7_data, map.snes_mode7_interleaved_data(tileset));
-      if (verbose)
-        fmt::print("Saved snes_mode7 interleaved data to \"{}\"\n", settings.out_m7_data);
+      outputs.add("write mode7 data", "snes_mode7 interleaved data", settings.out_m7_data,
+                  [&](const std::string& path) { sfc::write_file(path, map.snes_mode7_interleaved_data(tileset)); });
     }
 
     if (settings.mode == sfc::Mode::gbc && !settings.out_gbc_bank.empty()) {
-      sfc::write_file(settings.out_gbc_bank, map.gbc_banked_data());
-      if (verbose)
-        fmt::print("Saved gbc banked map data to \"{}\"\n", settings.out_gbc_bank);
+      outputs.add("write gbc bank", "gbc banked map data", settings.out_gbc_bank,
+                  [&](const std::string& path) { sfc::write_file(path, map.gbc_banked_data()); });
     }
 
+    outputs.write(settings.jobs, verbose);
+
   } catch (const std::exception& e) {
     fmt::print(stderr, "Error: {}\n", e.what());
     return 1;
@@ -6,7 +6,9 @@
 #include <Options.h>
 #include "Common.h"
 #include "Image.h"
+#include "Output.h"
 #include "Palette.h"
+#include "Trace.h"
 
 namespace SfcPalette {
 struct Settings {
@@ -24,14 +26,19 @@ struct Settings {
   bool no_remap;
   bool sprite_mode;
   std::string color_zero;
+  std::string color_order;
+  unsigned jobs;
 };
 }; // namespace SfcPalette
 
 int sfc_palette(int argc, char* argv[]) {
   SfcPalette::Settings settings = {};
   bool verbose = false;
+  std::string trace_path;
+  sfc::trace::Session trace_session;
   bool col0_forced = false;
   rgba_t col0 = 0;
+  sfc::color_order_t color_order;
 
   try {
     bool help = false;
@@ -56,8 +63,11 @@ int sfc_palette(int argc, char* argv[]) {
     options.AddSwitch(settings.no_remap,     'R', "no-remap",       "Don't remap colors",               false,               "Settings");
     options.AddSwitch(settings.sprite_mode,  'S', "sprite-mode",    "Apply sprite output settings",     false,               "Settings");
     options.Add(settings.color_zero,         '0', "color-zero",     "Set color #0",                     std::string(),       "Settings");
+    options.Add(settings.color_order,       '\0', "color-order",    "Color order (hue/frequency/planes)", std::string("hue"), "Settings");
+    options.Add(settings.jobs,              '\0', "jobs",           "Worker threads (0: one per core)", unsigned(0),         "Settings");
 
     options.AddSwitch(verbose,               'v', "verbose",        "Verbose logging", false, "_");
+    options.Add(trace_path,                 '\0', "trace",          "Write trace events to json file", std::string(), "_");
     options.AddSwitch(help,                  'h', "help",           "Show this help",  false, "_");
     // clang-format on
 
@@ -92,12 +102,17 @@ int sfc_palette(int argc, char* argv[]) {
       col0_forced = true;
     }
 
+    color_order = sfc::color_order(settings.color_order);
+
+    trace_session.start(trace_path);
+
   } catch (const std::exception& e) {
     fmt::print(stderr, "Error: {}\n", e.what());
     return 1;
   }
 
   try {
+    SFC_TRACE_SPAN("sfc_palette", settings.in_image);
     if (settings.in_image.empty())
       throw std::runtime_error("Input image required");
 
@@ -137,41 +152,32 @@ int sfc_palette(int argc, char* argv[]) {
         palette.prime_col0(col0);
       }
 
-      palette.add_images(image.crops(settings.tile_w, settings.tile_h, settings.mode));
+      SFC_TRACE_SPAN("palette");
+      const sfc::TileGrid grid(image, settings.tile_w, settings.tile_h, settings.mode);
+      palette.add_images(grid);
+      palette.sort(color_order, &grid);
     }
 
     if (verbose)
       fmt::print("Created palette with {}\n", palette.description());
 
-    if (!settings.no_remap) {
-      palette.sort();
-    }
-
     // Write data
-    if (!settings.out_data.empty()) {
-      palette.save(settings.out_data);
-      if (verbose)
-        fmt::print("Saved native palette data to \"{}\"\n", settings.out_data);
-    }
+    sfc::OutputQueue outputs;
 
-    if (!settings.out_act.empty()) {
-      palette.save_act(settings.out_act);
-      if (verbose)
-        fmt::print("Saved ACT palette to \"{}\"\n", settings.out_act);
-    }
+    if (!settings.out_data.empty())
+      outputs.add("write palette", "native palette data", settings.out_data, [&](const std::string& path) { palette.save(path); });
 
-    if (!settings.out_image.empty()) {
-      sfc::Image palette_image(palette);
-      palette_image.save(settings.out_image);
-      if (verbose)
-        fmt::print("Saved palette image to \"{}\"\n", settings.out_image);
-    }
+    if (!settings.out_act.empty())
+      outputs.add("write act palette", "ACT palette", settings.out_act, [&](const std::string& path) { palette.save_act(path); });
 
-    if (!settings.out_json.empty()) {
-      sfc::write_file(settings.out_json, palette.to_json());
-      if (verbose)
-        fmt::print("Saved JSON data to \"{}\"\n", settings.out_json);
-    }
+    if (!settings.out_image.empty())
+      outputs.add("write palette image", "palette image", settings.out_image,
+                  [&](const std::string& path) { sfc::Image(palette).save(path); });
+
+    if (!settings.out_json.empty())
+      outputs.add("write json", "JSON data", settings.out_json, [&](const std::string& path) { palette.save_json(path); });
+
+    outputs.write(settings.jobs, verbose);
 
   } catch (const std::exception& e) {
     fmt::print(stderr, "Error: {}\n", e.what());
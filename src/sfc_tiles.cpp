@@ -5,9 +5,13 @@
 
 #include <Options.h>
 #include "Common.h"
+#include "CropIndex.h"
 #include "Image.h"
+#include "Output.h"
 #include "Palette.h"
+#include "Parallel.h"
 #include "Tiles.h"
+#include "Trace.h"
 
 namespace SfcTiles {
 struct Settings {
@@ -16,6 +20,7 @@ struct Settings {
   std::string in_palette;
   std::string out_data;
   std::string out_image;
+  std::string out_index;
 
   sfc::Mode mode;
   unsigned bpp;
@@ -27,12 +32,15 @@ struct Settings {
   bool sprite_mode;
   unsigned max_tiles;
   unsigned out_image_width;
+  unsigned jobs;
 };
 }; // namespace SfcTiles
 
 int sfc_tiles(int argc, char* argv[]) {
   SfcTiles::Settings settings = {};
   bool verbose = false;
+  std::string trace_path;
+  sfc::trace::Session trace_session;
 
   try {
     bool help = false;
@@ -45,9 +53,10 @@ int sfc_tiles(int argc, char* argv[]) {
     // clang-format off
     options.Add(settings.in_image,           'i', "in-image",       "Input: image");
     options.Add(settings.in_data,            'n', "in-data",        "Input: native data");
-    options.Add(settings.in_palette,         'p', "in-palette",     "Input: palette (native/json)");
+    options.Add(settings.in_palette,         'p', "in-palette",     "Input: palette (native/json/act/gpl/jasc)");
     options.Add(settings.out_data,           'd', "out-data",       "Output: native data");
     options.Add(settings.out_image,          'o', "out-image",      "Output: image");
+    options.Add(settings.out_index,         '\0', "out-index",      "Output: tile lookup index (for map)");
 
     options.Add(mode_str,                    'M', "mode",           "Mode <default: snes>",              std::string("snes"), "Settings");
     options.Add(settings.bpp,                'B', "bpp",            "Bits per pixel",                    unsigned(4),         "Settings");
@@ -59,8 +68,10 @@ int sfc_tiles(int argc, char* argv[]) {
     options.AddSwitch(settings.sprite_mode,  'S', "sprite-mode",    "Apply sprite output settings",      false,               "Settings");
     options.Add(settings.max_tiles,          'T', "max-tiles",      "Maximum number of tiles",           unsigned(),          "Settings");
     options.Add(settings.out_image_width,   '\0', "out-image-width","Width of out-image",                unsigned(),          "Settings");
+    options.Add(settings.jobs,              '\0', "jobs",           "Worker threads (0: one per core)",  unsigned(0),         "Settings");
 
     options.AddSwitch(verbose,               'v', "verbose",        "Verbose logging", false, "_");
+    options.Add(trace_path,                 '\0', "trace",          "Write trace events to json file", std::string(), "_");
     options.AddSwitch(help,                  'h', "help",           "Show this help",  false, "_");
     // clang-format on
 
@@ -112,12 +123,15 @@ int sfc_tiles(int argc, char* argv[]) {
     if (!sfc::bpp_allowed_for_mode(settings.bpp, settings.mode))
       throw std::runtime_error("bpp setting not allowed for specified mode");
 
+    trace_session.start(trace_path);
+
   } catch (const std::exception& e) {
     fmt::print(stderr, "Error: {}\n", e.what());
     return 1;
   }
 
   try {
+    SFC_TRACE_SPAN("sfc_tiles", settings.in_image.empty() ? settings.in_data : settings.in_image);
     if (settings.in_image.empty() && settings.in_data.empty())
       throw std::runtime_error("Input image or native data required");
 
@@ -126,6 +140,10 @@ int sfc_tiles(int argc, char* argv[]) {
 
     sfc::Tileset tileset;
 
+    // native data of the first encoded_tiles tiles, encoded as they are added
+    byte_vec_t native_data;
+    unsigned encoded_tiles = 0;
+
     if (!settings.in_data.empty()) {
       // Native data input
       tileset = sfc::Tileset(sfc::read_binary(settings.in_data), settings.mode, settings.bpp, settings.tile_w, settings.tile_h,
@@ -136,7 +154,8 @@ int sfc_tiles(int argc, char* argv[]) {
     } else {
       // Image input
       sfc::Image image(settings.in_image);
-      std::vector<sfc::Image> crops = image.crops(settings.tile_w, settings.tile_h, settings.mode);
+      const unsigned columns = sfc::div_ceil(image.width(), settings.tile_w);
+      const unsigned rows = sfc::div_ceil(image.height(), settings.tile_h);
       if (verbose)
         fmt::print("Loaded image from \"{}\" ({})\n", settings.in_image, image.description());
 
@@ -146,7 +165,7 @@ int sfc_tiles(int argc, char* argv[]) {
       }
 
       if (verbose)
-        fmt::print("Image sliced into {} {}x{}px tiles\n", crops.size(), settings.tile_w, settings.tile_h);
+        fmt::print("Image sliced into {} {}x{}px tiles\n", columns * rows, settings.tile_w, settings.tile_h);
 
       sfc::Palette palette;
       tileset = sfc::Tileset(settings.mode, settings.bpp, settings.tile_w, settings.tile_h, settings.no_discard, settings.no_flip,
@@ -168,8 +187,29 @@ int sfc_tiles(int argc, char* argv[]) {
           fmt::print("Remapping tile data from palette \"{}\" ({})\n", settings.in_palette, palette.description());
       }
 
-      for (auto& img : crops)
-        tileset.add(img, &palette);
+      SFC_TRACE_SPAN("tileset");
+      // slice the image in bands of tiles while the previous band is remapped, deduplicated and its new tiles encoded
+      // bands share crop ids, so tiles repeating a tile of an earlier band are not remapped again
+      const unsigned band_rows = sfc::pipeline_band_rows(columns);
+      const unsigned bands = sfc::div_ceil(rows, band_rows);
+      sfc::CropIndex crops;
+      sfc::pipeline(
+        bands, sfc::Constants::pipeline_depth, settings.jobs,
+        [&](size_t band) {
+          SFC_TRACE_SPAN("slice band");
+          return sfc::TileGrid(image, settings.tile_w, settings.tile_h, settings.mode, (unsigned)band * band_rows, band_rows,
+                               crops);
+        },
+        [&](size_t band, sfc::TileGrid grid) {
+          const unsigned first_new = tileset.size();
+          tileset.add(grid, &palette, settings.jobs, band + 1 == bands);
+          if (tileset.encodes_by_tile() && !tileset.is_full()) {
+            SFC_TRACE_SPAN("encode band");
+            const auto band_data = tileset.native_data(first_new, tileset.size() - first_new);
+            native_data.insert(native_data.end(), band_data.begin(), band_data.end());
+            encoded_tiles = tileset.size();
+          }
+        });
       if (tileset.is_full()) {
         throw std::runtime_error(
           fmt::format("Tileset exceeds maximum size ({} entries generated, {} maximum)", tileset.size(), tileset.max()));
@@ -185,23 +225,41 @@ int sfc_tiles(int argc, char* argv[]) {
     }
 
     // Write data
-    if (!settings.out_data.empty()) {
-      tileset.save(settings.out_data);
-      if (verbose)
-        fmt::print("Saved native tile data to \"{}\"\n", settings.out_data);
+    if (!settings.out_index.empty() && settings.mode == sfc::Mode::pce_sprite)
+      throw std::runtime_error("Tile index output not available in pce_sprite mode");
+
+    sfc::OutputQueue outputs;
+
+    if ((!settings.out_data.empty() || !settings.out_index.empty()) && encoded_tiles != tileset.size())
+      native_data = tileset.native_data();
+
+    if (!settings.out_data.empty())
+      outputs.add("write tiles", "native tile data", settings.out_data,
+                  [&](const std::string& path) { sfc::write_file(path, native_data); });
+
+    if (!settings.out_index.empty()) {
+      outputs.add("write tile index", "tile lookup index", settings.out_index, [&](const std::string& path) {
+        // index the tileset as the map command will load it from native data
+        sfc::Tileset native_tileset(native_data, settings.mode, settings.bpp, settings.tile_w, settings.tile_h,
+                                    settings.no_flip);
+        native_tileset.build_index();
+        native_tileset.save_index(path);
+      });
     }
 
     if (!settings.out_image.empty()) {
-      sfc::Image tileset_image(tileset, settings.out_image_width);
-      if (!settings.in_data.empty()) {
-        tileset_image.save_indexed(settings.out_image);
-      } else {
-        tileset_image.save(settings.out_image);
-      }
-      if (verbose)
-        fmt::print("Saved tileset image to \"{}\"\n", settings.out_image);
+      outputs.add("write tiles image", "tileset image", settings.out_image, [&](const std::string& path) {
+        sfc::Image tileset_image(tileset, settings.out_image_width);
+        if (!settings.in_data.empty()) {
+          tileset_image.save_indexed(path);
+        } else {
+          tileset_image.save(path);
+        }
+      });
     }
 
+    outputs.write(settings.jobs, verbose);
+
   } catch (const std::exception& e) {
     fmt::print(stderr, "Error: {}\n", e.what());
     return 1;
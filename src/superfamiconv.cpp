@@ -11,10 +11,14 @@
 #include "About.h"
 #include "Color.h"
 #include "Common.h"
+#include "CropIndex.h"
 #include "Image.h"
 #include "Map.h"
+#include "Output.h"
 #include "Palette.h"
+#include "Parallel.h"
 #include "Tiles.h"
+#include "Trace.h"
 
 extern int sfc_palette(int argc, char* argv[]);
 extern int sfc_tiles(int argc, char* argv[]);
@@ -42,6 +46,8 @@ struct Settings {
   int palette_base_offset;
   bool sprite_mode;
   std::string color_zero;
+  std::string color_order;
+  unsigned jobs;
 };
 
 int superfamiconv(int argc, char* argv[]) {
@@ -49,6 +55,9 @@ int superfamiconv(int argc, char* argv[]) {
   bool verbose = false;
   bool col0_forced = false;
   rgba_t col0 = 0;
+  sfc::color_order_t color_order;
+  std::string trace_path;
+  sfc::trace::Session trace_session;
 
   try {
     bool help;
@@ -87,8 +96,11 @@ int superfamiconv(int argc, char* argv[]) {
     options.Add(settings.palette_base_offset, 'P', "palette-base-offset",  "Palette base offset for map data",  int(0),              "Settings");
     options.AddSwitch(settings.sprite_mode,   'S', "sprite-mode",          "Apply sprite output settings",      false,               "Settings");
     options.Add(settings.color_zero,          '\0', "color-zero",           "Set color #0", std::string(),                           "Settings");
+    options.Add(settings.color_order,         '\0', "color-order",          "Color order (hue/frequency/planes)", std::string("hue"), "Settings");
+    options.Add(settings.jobs,                '\0', "jobs",                 "Worker threads (0: one per core)",  unsigned(0),         "Settings");
 
     options.AddSwitch(verbose,                'v', "verbose",              "Verbose logging", false, "_");
+    options.Add(trace_path,                   '\0', "trace",               "Write trace events to json file", std::string(), "_");
     options.AddSwitch(license,                'l', "license",              "Show licenses",   false, "_");
     options.AddSwitch(help,                   'h', "help",                 "Show this help",  false, "_");
     // clang-format on
@@ -134,12 +146,23 @@ int superfamiconv(int argc, char* argv[]) {
       col0_forced = true;
     }
 
+    color_order = sfc::color_order(settings.color_order);
+
+    if (settings.tile_base_offset < -(int)sfc::Map::max_tile_index || settings.tile_base_offset > (int)sfc::Map::max_tile_index)
+      throw std::runtime_error(fmt::format("tile-base-offset must be between -{0} and {0}", sfc::Map::max_tile_index));
+    if (settings.palette_base_offset < -(int)sfc::Map::max_palette_index ||
+        settings.palette_base_offset > (int)sfc::Map::max_palette_index)
+      throw std::runtime_error(fmt::format("palette-base-offset must be between -{0} and {0}", sfc::Map::max_palette_index));
+
+    trace_session.start(trace_path);
+
   } catch (const std::exception& e) {
     fmt::print(stderr, "Error: {}\n", e.what());
     return 1;
   }
 
   try {
+    SFC_TRACE_SPAN("superfamiconv", settings.in_image);
     if (settings.in_image.empty())
       throw std::runtime_error("Input image required");
 
@@ -152,6 +175,7 @@ int superfamiconv(int argc, char* argv[]) {
 
     // Write color-scaled image
     if (!settings.out_scaled_image.empty()) {
+      SFC_TRACE_SPAN("write scaled image", settings.out_scaled_image);
       image.save_scaled(settings.out_scaled_image, settings.mode);
       if (verbose)
         fmt::print("Saved image scaled to destination colorspace to \"{}\"\n", settings.out_scaled_image);
@@ -162,9 +186,20 @@ int superfamiconv(int argc, char* argv[]) {
         throw std::runtime_error("pce/sprite-mode requires image dimensions to be a multiple of 16");
     }
 
+    // Slice image once, the tile grids are shared by the palette, tileset and map stages
+    // (crops extending past the image edge match those of an image padded to whole tiles)
+    // the palette stage needs the whole image sliced up front, except with no-remap where the image palette is used as is,
+    // and bands are then sliced while the previous band is added to the tileset
+    const unsigned columns = sfc::div_ceil(image.width(), settings.tile_w);
+    const unsigned rows = sfc::div_ceil(image.height(), settings.tile_h);
+    std::vector<sfc::TileGrid> grids;
+    if (!settings.no_remap)
+      grids.emplace_back(image, settings.tile_w, settings.tile_h, settings.mode);
+
     // Make palette
     sfc::Palette palette;
     {
+      SFC_TRACE_SPAN("palette");
       unsigned palette_count = sfc::default_palette_count_for_mode(settings.mode);
       unsigned colors_per_palette = sfc::palette_size_at_bpp(settings.bpp);
 
@@ -195,8 +230,8 @@ int superfamiconv(int argc, char* argv[]) {
           palette.prime_col0(col0);
         }
 
-        palette.add_images(image.crops(settings.tile_w, settings.tile_h, settings.mode));
-        palette.sort();
+        palette.add_images(grids.front());
+        palette.sort(color_order, &grids.front());
       }
       if (verbose)
         fmt::print("Created palette with {}\n", palette.description());
@@ -206,10 +241,26 @@ int superfamiconv(int argc, char* argv[]) {
     sfc::Tileset tileset(settings.mode, settings.bpp, settings.tile_w, settings.tile_h, settings.no_discard, settings.no_flip,
                          settings.no_remap, sfc::max_tile_count_for_mode(settings.mode));
     {
-      std::vector<sfc::Image> crops = image.crops(settings.tile_w, settings.tile_h, settings.mode);
-
-      for (auto& crop : crops)
-        tileset.add(crop, &palette);
+      SFC_TRACE_SPAN("tileset");
+      if (settings.no_remap) {
+        // bands share crop ids, so tiles repeating a tile of an earlier band are not added again
+        const unsigned band_rows = sfc::pipeline_band_rows(columns);
+        const unsigned bands = sfc::div_ceil(rows, band_rows);
+        sfc::CropIndex crops;
+        sfc::pipeline(
+          bands, sfc::Constants::pipeline_depth, settings.jobs,
+          [&](size_t band) {
+            SFC_TRACE_SPAN("slice band");
+            return sfc::TileGrid(image, settings.tile_w, settings.tile_h, settings.mode, (unsigned)band * band_rows, band_rows,
+                                 crops);
+          },
+          [&](size_t band, sfc::TileGrid grid) {
+            tileset.add(grid, &palette, settings.jobs, band + 1 == bands);
+            grids.push_back(std::move(grid));
+          });
+      } else {
+        tileset.add(grids.front(), &palette, settings.jobs);
+      }
       if (tileset.is_full()) {
         throw std::runtime_error(
           fmt::format("Tileset exceeds maximum size ({} entries generated, {} maximum)", tileset.size(), tileset.max()));
@@ -225,21 +276,16 @@ int superfamiconv(int argc, char* argv[]) {
     }
 
     // Make map
-    unsigned map_width = sfc::div_ceil(image.width(), settings.tile_w);
-    unsigned map_height = sfc::div_ceil(image.height(), settings.tile_h);
-
-    if (map_width * settings.tile_w != image.width() || map_height * settings.tile_h != image.height()) {
-      image = image.crop(0, 0, map_width * settings.tile_w, map_height * settings.tile_h, settings.mode);
-    }
-
-    sfc::Map map(settings.mode, map_width, map_height, settings.tile_w, settings.tile_h);
+    sfc::Map map(settings.mode, columns, rows, settings.tile_w, settings.tile_h);
     if (settings.mode != sfc::Mode::pce_sprite) {
-      std::vector<sfc::Image> crops = image.crops(settings.tile_w, settings.tile_h, settings.mode);
+      SFC_TRACE_SPAN("map");
       if (verbose)
-        fmt::print("Mapping {} {}x{}px tiles from image\n", crops.size(), settings.tile_w, settings.tile_h);
+        fmt::print("Mapping {} {}x{}px tiles from image\n", columns * rows, settings.tile_w, settings.tile_h);
 
-      for (unsigned i = 0; i < crops.size(); ++i) {
-        map.add(crops[i], tileset, palette, settings.bpp, i % map_width, i / map_width);
+      unsigned first_index = 0;
+      for (const auto& grid : grids) {
+        map.add(grid, tileset, palette, settings.bpp, settings.jobs, first_index);
+        first_index += grid.size();
       }
 
       if (settings.tile_base_offset)
@@ -250,47 +296,35 @@ int superfamiconv(int argc, char* argv[]) {
     }
 
     // Write data
-    if (!settings.out_palette.empty()) {
-      palette.save(settings.out_palette);
-      if (verbose)
-        fmt::print("Saved native palette data to \"{}\"\n", settings.out_palette);
-    }
+    sfc::OutputQueue outputs;
 
-    if (!settings.out_tiles.empty()) {
-      tileset.save(settings.out_tiles);
-      if (verbose)
-        fmt::print("Saved native tile data to \"{}\"\n", settings.out_tiles);
-    }
+    if (!settings.out_palette.empty())
+      outputs.add("write palette", "native palette data", settings.out_palette, [&](const std::string& path) { palette.save(path); });
+
+    if (!settings.out_tiles.empty())
+      outputs.add("write tiles", "native tile data", settings.out_tiles, [&](const std::string& path) { tileset.save(path); });
 
     if (!settings.out_map.empty()) {
       if (settings.mode == sfc::Mode::pce_sprite) {
         fmt::print(stderr, "Map output not available in pce_sprite mode\n");
       } else {
-        map.save(settings.out_map);
-        if (verbose)
-          fmt::print("Saved native map data to \"{}\"\n", settings.out_map);
+        outputs.add("write map", "native map data", settings.out_map, [&](const std::string& path) { map.save(path); });
       }
     }
 
-    if (!settings.out_palette_act.empty()) {
-      palette.save_act(settings.out_palette_act);
-      if (verbose)
-        fmt::print("Saved photoshop palette to \"{}\"\n", settings.out_palette_act);
-    }
+    if (!settings.out_palette_act.empty())
+      outputs.add("write act palette", "photoshop palette", settings.out_palette_act,
+                  [&](const std::string& path) { palette.save_act(path); });
 
-    if (!settings.out_palette_image.empty()) {
-      sfc::Image palette_image(palette);
-      palette_image.save(settings.out_palette_image);
-      if (verbose)
-        fmt::print("Saved palette image to \"{}\"\n", settings.out_palette_image);
-    }
+    if (!settings.out_palette_image.empty())
+      outputs.add("write palette image", "palette image", settings.out_palette_image,
+                  [&](const std::string& path) { sfc::Image(palette).save(path); });
 
-    if (!settings.out_tiles_image.empty()) {
-      sfc::Image tileset_image(tileset);
-      tileset_image.save(settings.out_tiles_image);
-      if (verbose)
-        fmt::print("Saved tileset image to \"{}\"\n", settings.out_tiles_image);
-    }
+    if (!settings.out_tiles_image.empty())
+      outputs.add("write tiles image", "tileset image", settings.out_tiles_image,
+                  [&](const std::string& path) { sfc::Image(tileset).save(path); });
+
+    outputs.write(settings.jobs, verbose);
 
   } catch (const std::exception& e) {
     fmt::print(stderr, "Error: {}\n", e.what());